@@ -0,0 +1,120 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "composite.h"
+#include "mumble.h"
+#include "pixels.h"
+
+static void add_all(struct damage* to, struct damage* from);
+static void composite_rect(struct app_state* state,
+                           const struct damage_rect* r);
+static void clear_rect(struct app_state* state, const struct damage_rect* r);
+
+void composite(struct app_state* state) {
+  struct damage fresh;
+  unsigned int i;
+
+  /* shown straight from the shm, nothing to blend */
+  if (state->n_sources == 1) {
+    add_all(&state->damage, &state->stack_damage);
+    add_all(&state->damage, &state->sources[0].damage);
+    return;
+  }
+
+  damage_init(&fresh, state->damage.merge_slack);
+  add_all(&fresh, &state->stack_damage);
+  for (i = 0; i < state->n_sources; ++i)
+    add_all(&fresh, &state->sources[i].damage);
+  if (state->mumble_active_w * state->mumble_active_h == 0)
+    return;
+
+  if (!state->canvas) {
+    int err = posix_memalign(&state->canvas, PIXELS_CACHE_LINE,
+                             (size_t) 4 * state->mumble_width
+                             * state->mumble_height);
+    if (err) {
+      state->canvas = NULL;
+      fprintf(stderr, "posix_memalign: %s\n", strerror(err));
+      return;
+    }
+    state->mumble_shm_ptr = state->canvas;
+    damage_clear(&fresh);
+    damage_add(&fresh, state->mumble_active_x, state->mumble_active_y,
+               state->mumble_active_w, state->mumble_active_h);
+  }
+
+  damage_clip(&fresh, state->mumble_active_x, state->mumble_active_y,
+              state->mumble_active_w, state->mumble_active_h);
+  for (i = 0; i < fresh.n; ++i) {
+    const struct damage_rect* r = &fresh.rects[i];
+    composite_rect(state, r);
+    damage_add(&state->damage, r->x, r->y, r->w, r->h);
+  }
+}
+
+void composite_release(struct app_state* state) {
+  free(state->canvas);
+  state->canvas = NULL;
+  if (state->n_sources > 1)
+    state->mumble_shm_ptr = NULL;
+}
+
+static void add_all(struct damage* to, struct damage* from) {
+  unsigned int i;
+
+  for (i = 0; i < from->n; ++i)
+    damage_add(to, from->rects[i].x, from->rects[i].y,
+               from->rects[i].w, from->rects[i].h);
+  damage_clear(from);
+}
+
+/* rebuilds r from the sources, bottom up. the bottom one is copied if it
+   covers all of r, otherwise blended onto transparent. */
+static void composite_rect(struct app_state* state,
+                           const struct damage_rect* r) {
+  uint32_t* canvas = state->canvas;
+  size_t stride = state->mumble_width;
+  unsigned int i;
+  int drawn = 0;
+
+  for (i = 0; i < state->n_sources; ++i) {
+    struct mumble_source* src = &state->sources[i];
+    const uint32_t* shm = src->shm_ptr;
+    struct damage_rect active, part;
+    size_t offset;
+
+    active.x = src->active_x;
+    active.y = src->active_y;
+    active.w = src->active_w;
+    active.h = src->active_h;
+    if (!shm || !damage_rect_intersect(&part, r, &active))
+      continue;
+
+    offset = part.x + (size_t) part.y * stride;
+    mark_source_touched(state, src, offset, part.w, part.h);
+
+    if (!drawn && part.w == r->w && part.h == r->h) {
+      convert_rows(state->pool, &copy_rows, canvas + offset, stride,
+                   shm + offset, stride, part.w, part.h);
+    } else {
+      if (!drawn)
+        clear_rect(state, r);
+      convert_rows(state->pool, &blend_over_rows, canvas + offset, stride,
+                   shm + offset, stride, part.w, part.h);
+    }
+    drawn = 1;
+  }
+
+  if (!drawn)
+    clear_rect(state, r);
+}
+
+static void clear_rect(struct app_state* state, const struct damage_rect* r) {
+  uint32_t* row = (uint32_t*) state->canvas + r->x
+                  + (size_t) r->y * state->mumble_width;
+  size_t y;
+
+  for (y = 0; y < r->h; ++y, row += state->mumble_width)
+    memset(row, 0, (size_t) r->w * 4);
+}
@@ -0,0 +1,14 @@
+#ifndef OVERLAY_APP_COMPOSITE_H
+#define OVERLAY_APP_COMPOSITE_H
+
+#include "main.h"
+
+/* moves the sources' damage and the stack damage into state->damage. with
+   more than one source, what's under it is first blended into the canvas,
+   sources later in OVERLAY_THING_SOURCES on top. */
+void composite(struct app_state* state);
+
+/* frees the canvas; the next composite() rebuilds all of it. */
+void composite_release(struct app_state* state);
+
+#endif
@@ -0,0 +1,118 @@
+#include "damage.h"
+
+static size_t rect_area(const struct damage_rect* r);
+static struct damage_rect rect_union(const struct damage_rect* a,
+                                     const struct damage_rect* b);
+static size_t merge_waste(const struct damage_rect* a,
+                          const struct damage_rect* b);
+
+void damage_init(struct damage* d, size_t merge_slack) {
+  d->n = 0;
+  d->merge_slack = merge_slack;
+}
+
+void damage_clear(struct damage* d) {
+  d->n = 0;
+}
+
+void damage_add(struct damage* d, unsigned int x, unsigned int y,
+                unsigned int w, unsigned int h) {
+  struct damage_rect r;
+
+  if (w == 0 || h == 0 || x > UINT16_MAX || y > UINT16_MAX)
+    return;
+  if (w > UINT16_MAX - x)
+    w = UINT16_MAX - x;
+  if (h > UINT16_MAX - y)
+    h = UINT16_MAX - y;
+  r.x = (uint16_t) x;
+  r.y = (uint16_t) y;
+  r.w = (uint16_t) w;
+  r.h = (uint16_t) h;
+
+  /* fold r into its cheapest neighbour for as long as that's nearly free,
+     or we're out of slots. the union can swallow further rects, so go
+     around again with it. */
+  for (;;) {
+    unsigned int i, best = d->n;
+    size_t waste, best_waste = (size_t) -1;
+
+    for (i = 0; i < d->n; ++i) {
+      waste = merge_waste(&d->rects[i], &r);
+      if (waste < best_waste) {
+        best = i;
+        best_waste = waste;
+      }
+    }
+
+    if (best == d->n
+        || (best_waste > d->merge_slack && d->n < DAMAGE_MAX_RECTS))
+      break;
+
+    r = rect_union(&d->rects[best], &r);
+    d->rects[best] = d->rects[--d->n];
+  }
+
+  d->rects[d->n++] = r;
+}
+
+void damage_clip(struct damage* d, uint16_t x, uint16_t y,
+                 uint16_t w, uint16_t h) {
+  struct damage_rect clip;
+  unsigned int i;
+
+  clip.x = x;
+  clip.y = y;
+  clip.w = w;
+  clip.h = h;
+  for (i = 0; i < d->n;) {
+    if (damage_rect_intersect(&d->rects[i], &d->rects[i], &clip))
+      ++i;
+    else
+      d->rects[i] = d->rects[--d->n];
+  }
+}
+
+static size_t rect_area(const struct damage_rect* r) {
+  return (size_t) r->w * r->h;
+}
+
+static struct damage_rect rect_union(const struct damage_rect* a,
+                                     const struct damage_rect* b) {
+  struct damage_rect u;
+  unsigned int x1 = a->x + a->w > b->x + b->w ? a->x + a->w : b->x + b->w;
+  unsigned int y1 = a->y + a->h > b->y + b->h ? a->y + a->h : b->y + b->h;
+
+  u.x = a->x < b->x ? a->x : b->x;
+  u.y = a->y < b->y ? a->y : b->y;
+  u.w = (uint16_t) (x1 - u.x);
+  u.h = (uint16_t) (y1 - u.y);
+  return u;
+}
+
+int damage_rect_intersect(struct damage_rect* out,
+                          const struct damage_rect* a,
+                          const struct damage_rect* b) {
+  unsigned int x0 = a->x > b->x ? a->x : b->x;
+  unsigned int y0 = a->y > b->y ? a->y : b->y;
+  unsigned int x1 = a->x + a->w < b->x + b->w ? a->x + a->w : b->x + b->w;
+  unsigned int y1 = a->y + a->h < b->y + b->h ? a->y + a->h : b->y + b->h;
+
+  if (x0 >= x1 || y0 >= y1)
+    return 0;
+
+  out->x = (uint16_t) x0;
+  out->y = (uint16_t) y0;
+  out->w = (uint16_t) (x1 - x0);
+  out->h = (uint16_t) (y1 - y0);
+  return 1;
+}
+
+/* pixels the bounding box of a and b covers that neither of them does. */
+static size_t merge_waste(const struct damage_rect* a,
+                          const struct damage_rect* b) {
+  struct damage_rect u = rect_union(a, b), i;
+  size_t overlap = damage_rect_intersect(&i, a, b) ? rect_area(&i) : 0;
+
+  return rect_area(&u) + overlap - rect_area(a) - rect_area(b);
+}
@@ -0,0 +1,38 @@
+#ifndef OVERLAY_APP_DAMAGE_H
+#define OVERLAY_APP_DAMAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DAMAGE_MAX_RECTS 8
+
+/* by default two rects get merged when their bounding box covers at most
+   this many pixels neither of them asked for; a smaller upload isn't worth
+   a separate request. */
+#define DAMAGE_MERGE_SLACK 4096
+
+struct damage_rect {
+  uint16_t x, y, w, h;
+};
+
+/* the parts of the overlay that changed since the last upload. */
+struct damage {
+  unsigned int n;
+  size_t merge_slack;
+  struct damage_rect rects[DAMAGE_MAX_RECTS];
+};
+
+void damage_init(struct damage* d, size_t merge_slack);
+void damage_clear(struct damage* d);
+void damage_add(struct damage* d, unsigned int x, unsigned int y,
+                unsigned int w, unsigned int h);
+/* sets out to the overlap of a and b, returns 0 if there is none. out may
+   be a or b. */
+int damage_rect_intersect(struct damage_rect* out,
+                          const struct damage_rect* a,
+                          const struct damage_rect* b);
+/* drops everything outside of the given rect. */
+void damage_clip(struct damage* d, uint16_t x, uint16_t y,
+                 uint16_t w, uint16_t h);
+
+#endif
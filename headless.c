@@ -0,0 +1,645 @@
+#define _GNU_SOURCE /* for vmsplice, splice and F_SETPIPE_SZ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <linux/sockios.h>
+
+#include "headless.h"
+#include "mumble.h"
+#include "pixels.h"
+
+#define HEADLESS_DEFAULT_WIDTH 1920
+#define HEADLESS_DEFAULT_HEIGHT 1080
+
+/* how much we ask the kernel to buffer between us and the consumer;
+   /proc/sys/fs/pipe-max-size has the last word. */
+#define HEADLESS_PIPE_SIZE (1 << 20)
+
+/* how soon to look again after dropping a frame because the consumer
+   hadn't got through the one before the last yet. */
+#define HEADLESS_RETRY 0.005
+
+/* how often to look for a new consumer while there is none */
+#define HEADLESS_RECONNECT 0.5
+
+/* frames are built in one of two buffers and vmspliced from there, so the
+   stream holds references to our pages rather than copies. a buffer can
+   only be rebuilt once the consumer has read past its end. */
+struct headless_buf {
+  void* data;
+  size_t size, len;
+  /* bytes_out once the frame in here had been handed to the kernel */
+  unsigned long long end;
+};
+
+struct headless_output {
+  const char* path;
+  /* -1 while there is no consumer */
+  int fd;
+  int is_socket;
+  /* sockets can't take vmsplice, so frames go through this pipe and are
+     spliced on */
+  int relay[2];
+  size_t relay_len;
+  int timer_fd;
+  int timer_armed;
+  int raw;
+  int polling;
+  int geometry_changed;
+  int dropping;
+  /* a frame's damage is waiting for the consumer to catch up */
+  int waiting;
+  struct headless_buf bufs[2];
+  unsigned int cur;
+  size_t off;
+  unsigned long long bytes_out;
+  uint32_t seq;
+  unsigned long dropped;
+};
+
+static int headless_setup(struct app_state* state);
+static void headless_cleanup(struct app_state* state);
+static void headless_move_resize(struct app_state* state);
+static void headless_blit(struct app_state* state);
+static void send_frame(struct app_state* state);
+static void headless_release_buffers(struct app_state* state);
+static void headless_no_input(struct app_state* state);
+static int parse_size(struct app_state* state, const char* size);
+static int open_output(struct headless_output* h);
+static int make_relay(struct headless_output* h);
+static int connect_output(struct app_state* state);
+static void disconnect_output(struct app_state* state);
+static void set_pipe_size(int fd);
+static int buf_consumed(struct headless_output* h, unsigned int i);
+static int build_frame(struct app_state* state, struct headless_buf* buf);
+static int pump(struct app_state* state);
+static int set_polling(struct app_state* state, int want_out);
+static void arm_retry_timer(struct headless_output* h, double seconds);
+static int on_output_write(struct app_state* state, uint32_t events,
+                           void* data);
+static int on_retry_timer_read(struct app_state* state, uint32_t events,
+                               void* data);
+
+static my_epoll_cb output_cb = &on_output_write;
+static my_epoll_cb retry_timer_cb = &on_retry_timer_read;
+
+const struct output_backend headless_output = {
+  &headless_setup,
+  &headless_cleanup,
+  &headless_move_resize,
+  &headless_blit,
+  &headless_release_buffers,
+  &headless_no_input,
+  &headless_no_input
+};
+
+static int headless_setup(struct app_state* state) {
+  struct headless_output* h;
+  struct epoll_event event;
+  const char* mode = getenv("OVERLAY_THING_OUTPUT_MODE");
+  const char* size = getenv("OVERLAY_THING_SIZE");
+
+  state->frames_presented = 0;
+  state->interactive = state->input_grabbed = 0;
+  damage_init(&state->damage, DAMAGE_MERGE_SLACK);
+
+  if (parse_size(state, size) == -1)
+    return -1;
+
+  if (!(h = calloc(1, sizeof *h))) {
+    perror("calloc");
+    return -1;
+  }
+  state->headless = h;
+  h->path = getenv("OVERLAY_THING_OUTPUT");
+  h->fd = h->relay[0] = h->relay[1] = h->timer_fd = -1;
+
+  if (mode && strcmp(mode, "raw") == 0) {
+    h->raw = 1;
+  } else if (mode && strcmp(mode, "delta") != 0) {
+    fputs("OVERLAY_THING_OUTPUT_MODE must be raw or delta\n", stderr);
+    return -1;
+  }
+
+  h->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (h->timer_fd == -1) {
+    perror("timerfd_create");
+    return -1;
+  }
+
+  event.events = EPOLLIN;
+  event.data.ptr = &retry_timer_cb;
+  if (epoll_ctl(state->epoll_fd, EPOLL_CTL_ADD, h->timer_fd, &event) == -1) {
+    perror("epoll_ctl (retry timer)");
+    return -1;
+  }
+
+  if (open_output(h) == -1)
+    return -1;
+
+  printf("writing %s frames of %ux%u to %s\n", h->raw ? "raw" : "delta",
+         (unsigned int) state->screen_res_width,
+         (unsigned int) state->screen_res_height, h->path);
+  if (connect_output(state) == -1) {
+    puts("waiting for a consumer");
+    arm_retry_timer(h, HEADLESS_RECONNECT);
+  }
+  return 0;
+}
+
+static void headless_cleanup(struct app_state* state) {
+  struct headless_output* h = state->headless;
+  unsigned int i;
+
+  if (!h)
+    return;
+
+  if (h->fd != -1)
+    close(h->fd);
+  if (h->relay[0] != -1)
+    close(h->relay[0]);
+  if (h->relay[1] != -1)
+    close(h->relay[1]);
+  if (h->timer_fd != -1)
+    close(h->timer_fd);
+  /* the stream is gone, so nothing references the buffers any more */
+  for (i = 0; i < 2; ++i)
+    free(h->bufs[i].data);
+  if (h->dropped)
+    printf("dropped %lu frames the consumer wasn't ready for\n", h->dropped);
+
+  free(h);
+  state->headless = NULL;
+}
+
+/* with no window to move, the next frame just has to carry the new active
+   rect, damaged or not. */
+static void headless_move_resize(struct app_state* state) {
+  state->headless->geometry_changed = 1;
+}
+
+/* a new frame from mumble. one still waiting to go out gets merged into it
+   and is never seen on its own, which is what counts as dropped. */
+static void headless_blit(struct app_state* state) {
+  struct headless_output* h = state->headless;
+
+  if (h->waiting)
+    ++h->dropped;
+  send_frame(state);
+}
+
+/* builds a frame out of the damage, unless the consumer is still behind on
+   the last one or the one before; then the damage waits for the next try. */
+static void send_frame(struct app_state* state) {
+  struct headless_output* h = state->headless;
+  unsigned int next = h->cur ^ 1;
+
+  /* whoever connects next starts with everything, see connect_output() */
+  if (h->fd == -1) {
+    damage_clear(&state->damage);
+    h->waiting = 0;
+    if (!h->timer_armed && !state->idle)
+      arm_retry_timer(h, HEADLESS_RECONNECT);
+    return;
+  }
+
+  if (!state->mumble_shm_ptr
+      || state->mumble_active_w * state->mumble_active_h == 0)
+    damage_clear(&state->damage);
+  else
+    damage_clip(&state->damage,
+                state->mumble_active_x, state->mumble_active_y,
+                state->mumble_active_w, state->mumble_active_h);
+  h->waiting = 0;
+  if (state->damage.n == 0 && !h->geometry_changed)
+    return;
+
+  /* on_output_write() calls back once this one is out */
+  h->waiting = 1;
+  if (h->off < h->bufs[h->cur].len || h->relay_len)
+    return;
+
+  if (!buf_consumed(h, next)) {
+    if (!h->dropping)
+      fputs("output consumer is behind, dropping frames\n", stderr);
+    h->dropping = 1;
+    arm_retry_timer(h, HEADLESS_RETRY);
+    return;
+  }
+  h->dropping = 0;
+  h->waiting = 0;
+
+  if (build_frame(state, &h->bufs[next]) == -1)
+    return;
+  h->cur = next;
+  h->off = 0;
+  h->geometry_changed = 0;
+  damage_clear(&state->damage);
+  ++state->frames_presented;
+
+  if (pump(state) == -1)
+    disconnect_output(state);
+}
+
+/* buffers the stream may still reference stay around; the next frame
+   that finds them consumed reuses them as usual. */
+static void headless_release_buffers(struct app_state* state) {
+  struct headless_output* h = state->headless;
+  unsigned int i;
+
+  arm_retry_timer(h, 0);
+  if (h->off < h->bufs[h->cur].len || h->relay_len)
+    return;
+
+  for (i = 0; i < 2; ++i) {
+    if (!buf_consumed(h, i))
+      continue;
+    free(h->bufs[i].data);
+    h->bufs[i].data = NULL;
+    h->bufs[i].size = h->bufs[i].len = 0;
+  }
+}
+
+/* nothing to grab input from */
+static void headless_no_input(struct app_state* state) {
+  (void) state;
+}
+
+static int parse_size(struct app_state* state, const char* size) {
+  unsigned long w = HEADLESS_DEFAULT_WIDTH, h = HEADLESS_DEFAULT_HEIGHT;
+
+  if (size) {
+    char* end;
+    w = strtoul(size, &end, 10);
+    if (*end != 'x')
+      w = 0;
+    else
+      h = strtoul(end + 1, &end, 10);
+    if (*end || w == 0 || h == 0 || w > UINT16_MAX || h > UINT16_MAX) {
+      fputs("OVERLAY_THING_SIZE must look like 1920x1080\n", stderr);
+      return -1;
+    }
+  }
+
+  state->screen_res_width = (uint16_t) w;
+  state->screen_res_height = (uint16_t) h;
+  return 0;
+}
+
+/* checks what we're writing to; connect_output() opens it. */
+static int open_output(struct headless_output* h) {
+  struct stat st;
+
+  if (stat(h->path, &st) == -1) {
+    perror(h->path);
+    return -1;
+  }
+
+  /* a consumer going away shows up as EPOLLERR or EPIPE, and splice() has
+     no MSG_NOSIGNAL */
+  signal(SIGPIPE, SIG_IGN);
+
+  if (S_ISFIFO(st.st_mode))
+    return 0;
+
+  if (S_ISSOCK(st.st_mode)) {
+    if (strlen(h->path) >= sizeof ((struct sockaddr_un*) NULL)->sun_path) {
+      fputs("OVERLAY_THING_OUTPUT path too long\n", stderr);
+      return -1;
+    }
+    h->is_socket = 1;
+    return make_relay(h);
+  }
+
+  fputs("OVERLAY_THING_OUTPUT must be a fifo or a unix socket\n", stderr);
+  return -1;
+}
+
+static int make_relay(struct headless_output* h) {
+  if (pipe2(h->relay, O_NONBLOCK | O_CLOEXEC) == -1) {
+    perror("pipe2");
+    h->relay[0] = h->relay[1] = -1;
+    return -1;
+  }
+  set_pipe_size(h->relay[1]);
+  return 0;
+}
+
+/* opens the fifo for writing, which only works while it has a reader, or
+   connects to the socket. every consumer gets a fresh pipe or connection,
+   so its stream starts with a whole frame, and that frame covers the whole
+   active rect whatever the mode. -1 if there's nobody there (yet). */
+static int connect_output(struct app_state* state) {
+  struct headless_output* h = state->headless;
+  struct epoll_event event;
+  int fd;
+
+  if (h->is_socket) {
+    struct sockaddr_un addr;
+
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, h->path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+      perror("socket");
+      return -1;
+    }
+    if (connect(fd, (struct sockaddr*) &addr, sizeof addr) == -1) {
+      if (errno != ECONNREFUSED && errno != ENOENT && errno != EAGAIN)
+        perror(h->path);
+      close(fd);
+      return -1;
+    }
+  } else {
+    if ((fd = open(h->path, O_WRONLY | O_NONBLOCK | O_CLOEXEC)) == -1) {
+      if (errno != ENXIO)
+        perror(h->path);
+      return -1;
+    }
+    set_pipe_size(fd);
+  }
+
+  /* EPOLLOUT only while a frame is being written, see set_polling() */
+  event.events = 0;
+  event.data.ptr = &output_cb;
+  if (epoll_ctl(state->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+    perror("epoll_ctl (output)");
+    close(fd);
+    return -1;
+  }
+
+  h->fd = fd;
+  h->polling = 0;
+  h->geometry_changed = 1;
+  if (state->mumble_shm_ptr
+      && state->mumble_active_w * state->mumble_active_h > 0)
+    damage_add(&state->damage,
+               state->mumble_active_x, state->mumble_active_y,
+               state->mumble_active_w, state->mumble_active_h);
+  return 0;
+}
+
+/* gives up on the current consumer, along with whatever part of a frame
+   it didn't get, and waits for the next one. mumble is served as usual in
+   the meantime. */
+static void disconnect_output(struct app_state* state) {
+  struct headless_output* h = state->headless;
+
+  fputs("output consumer went away, waiting for the next one\n", stderr);
+  close(h->fd);
+  h->fd = -1;
+  h->polling = 0;
+
+  /* with the pipe or socket gone, nothing references our buffers */
+  if (h->is_socket) {
+    close(h->relay[0]);
+    close(h->relay[1]);
+    if (make_relay(h) == -1)
+      fputs("can't write to sockets any more\n", stderr);
+  }
+  h->relay_len = 0;
+  h->off = h->bufs[h->cur].len;
+  h->bufs[0].end = h->bufs[1].end = 0;
+  h->dropping = h->waiting = 0;
+
+  damage_clear(&state->damage);
+  if (!state->idle)
+    arm_retry_timer(h, HEADLESS_RECONNECT);
+}
+
+static void set_pipe_size(int fd) {
+  if (fcntl(fd, F_SETPIPE_SZ, HEADLESS_PIPE_SIZE) == -1)
+    perror("fcntl (F_SETPIPE_SZ), keeping the default pipe size");
+}
+
+/* whether the consumer has read everything up to the end of buffer i.
+   what it hasn't is in the pipe, or for a socket in the relay pipe and the
+   socket's queue. SIOCOUTQ is no byte count, it includes the kernel's
+   overhead for those bytes, but it never says less than what's left. so
+   a buffer may be reported busy a bit longer than it is, never free
+   early. */
+static int buf_consumed(struct headless_output* h, unsigned int i) {
+  int queued = 0, outq = 0;
+
+  if (h->bufs[i].end == 0)
+    return 1;
+
+  if (ioctl(h->is_socket ? h->relay[0] : h->fd, FIONREAD, &queued) == -1
+      || (h->is_socket && ioctl(h->fd, SIOCOUTQ, &outq) == -1)) {
+    perror("ioctl (output queue)");
+    return 0;
+  }
+
+  return (unsigned long long) queued + (unsigned long long) outq
+         + h->bufs[i].end <= h->bytes_out;
+}
+
+static int build_frame(struct app_state* state, struct headless_buf* buf) {
+  struct headless_output* h = state->headless;
+  struct headless_frame frame;
+  struct headless_rect* rects;
+  const uint32_t* shm = state->mumble_shm_ptr;
+  uint32_t* pixels;
+  size_t size;
+  unsigned int i, n;
+
+  memset(&frame, 0, sizeof frame);
+  frame.magic = HEADLESS_FRAME_MAGIC;
+  frame.seq = h->seq;
+  frame.width = state->mumble_width;
+  frame.height = state->mumble_height;
+  frame.raw = (uint16_t) h->raw;
+
+  n = 0;
+  if (shm && state->mumble_active_w * state->mumble_active_h > 0) {
+    frame.active_x = state->mumble_active_x;
+    frame.active_y = state->mumble_active_y;
+    frame.active_w = state->mumble_active_w;
+    frame.active_h = state->mumble_active_h;
+    n = h->raw ? 1 : state->damage.n;
+  }
+  frame.n_rects = (uint16_t) n;
+
+  size = sizeof frame + n * sizeof *rects;
+  for (i = 0; i < n; ++i) {
+    const struct damage_rect* r = &state->damage.rects[i];
+    size += h->raw ? (size_t) 4 * frame.active_w * frame.active_h
+                   : (size_t) 4 * r->w * r->h;
+  }
+
+  if (size > buf->size) {
+    void* data;
+    int err;
+    /* page aligned, so vmsplice hands over whole pages */
+    if ((err = posix_memalign(&data, (size_t) sysconf(_SC_PAGESIZE),
+                              size))) {
+      fprintf(stderr, "posix_memalign: %s\n", strerror(err));
+      return -1;
+    }
+    free(buf->data);
+    buf->data = data;
+    buf->size = size;
+  }
+
+  memcpy(buf->data, &frame, sizeof frame);
+  rects = (struct headless_rect*) ((char*) buf->data + sizeof frame);
+  pixels = (uint32_t*) (rects + n);
+  for (i = 0; i < n; ++i) {
+    struct headless_rect* r = &rects[i];
+    size_t offset;
+
+    if (h->raw) {
+      r->x = frame.active_x;
+      r->y = frame.active_y;
+      r->w = frame.active_w;
+      r->h = frame.active_h;
+    } else {
+      r->x = state->damage.rects[i].x;
+      r->y = state->damage.rects[i].y;
+      r->w = state->damage.rects[i].w;
+      r->h = state->damage.rects[i].h;
+    }
+
+    offset = r->x + (size_t) r->y * state->mumble_width;
+    mark_shm_touched(state, offset, r->w, r->h);
+    convert_rows(state->pool, &copy_rows, pixels, r->w,
+                 shm + offset, state->mumble_width, r->w, r->h);
+    pixels += (size_t) r->w * r->h;
+  }
+
+  buf->len = size;
+  buf->end = 0;
+  ++h->seq;
+  return 0;
+}
+
+/* moves as much of the current frame towards the consumer as it takes
+   without blocking. */
+static int pump(struct app_state* state) {
+  struct headless_output* h = state->headless;
+  struct headless_buf* buf = &h->bufs[h->cur];
+
+  for (;;) {
+    struct iovec iov;
+    ssize_t ret;
+
+    if (h->relay_len) {
+      ret = splice(h->relay[0], NULL, h->fd, NULL, h->relay_len,
+                   SPLICE_F_NONBLOCK | SPLICE_F_MOVE);
+      if (ret == -1) {
+        if (errno == EINTR)
+          continue;
+        if (errno == EAGAIN)
+          break;
+        if (errno != EPIPE && errno != ECONNRESET)
+          perror("splice");
+        return -1;
+      }
+      h->relay_len -= (size_t) ret;
+      continue;
+    }
+
+    if (h->off == buf->len)
+      break;
+
+    iov.iov_base = (char*) buf->data + h->off;
+    iov.iov_len = buf->len - h->off;
+    ret = vmsplice(h->is_socket ? h->relay[1] : h->fd, &iov, 1,
+                   SPLICE_F_NONBLOCK);
+    if (ret == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN)
+        break;
+      if (errno != EPIPE)
+        perror("vmsplice");
+      return -1;
+    }
+    h->off += (size_t) ret;
+    h->bytes_out += (unsigned long long) ret;
+    if (h->is_socket)
+      h->relay_len += (size_t) ret;
+    if (h->off == buf->len)
+      buf->end = h->bytes_out;
+  }
+
+  return set_polling(state, h->off < buf->len || h->relay_len);
+}
+
+static int set_polling(struct app_state* state, int want_out) {
+  struct headless_output* h = state->headless;
+  struct epoll_event event;
+
+  if (want_out == h->polling)
+    return 0;
+
+  event.events = want_out ? EPOLLOUT : 0;
+  event.data.ptr = &output_cb;
+  if (epoll_ctl(state->epoll_fd, EPOLL_CTL_MOD, h->fd, &event) == -1) {
+    perror("epoll_ctl (output)");
+    return -1;
+  }
+  h->polling = want_out;
+  return 0;
+}
+
+/* one-shot; 0 disarms. */
+static void arm_retry_timer(struct headless_output* h, double seconds) {
+  if (arm_timerfd(h->timer_fd, seconds, 0) == 0)
+    h->timer_armed = seconds > 0;
+}
+
+static int on_output_write(struct app_state* state, uint32_t events,
+                           void* data) {
+  struct headless_output* h = state->headless;
+
+  if (events & (EPOLLERR | EPOLLHUP) || pump(state) == -1) {
+    disconnect_output(state);
+    return 0;
+  }
+
+  /* whatever piled up while this frame went out */
+  if (!h->polling)
+    send_frame(state);
+  return 0;
+}
+
+static int on_retry_timer_read(struct app_state* state, uint32_t events,
+                               void* data) {
+  struct headless_output* h = state->headless;
+  uint64_t expirations;
+
+  if (read(h->timer_fd, &expirations, sizeof expirations) == -1) {
+    if (errno == EAGAIN || errno == EINTR)
+      return 0;
+    perror("read (retry timer)");
+    return -1;
+  }
+  h->timer_armed = 0;
+
+  if (h->fd == -1) {
+    if (connect_output(state) == -1) {
+      if (!state->idle)
+        arm_retry_timer(h, HEADLESS_RECONNECT);
+      return 0;
+    }
+    puts("output consumer connected");
+  }
+
+  send_frame(state);
+  return 0;
+}
@@ -0,0 +1,46 @@
+#ifndef OVERLAY_APP_HEADLESS_H
+#define OVERLAY_APP_HEADLESS_H
+
+#include <stdint.h>
+
+#include "main.h"
+
+/* the stream written to OVERLAY_THING_OUTPUT is a sequence of frames, all
+   fields in native byte order: a struct headless_frame, n_rects struct
+   headless_rect, then the pixels of each rect in the same order, rows of
+   w native endian premultiplied 0xAARRGGBB pixels without padding.
+
+   rects are in canvas pixels. in delta mode they are what changed since
+   the previous frame, in raw mode there is one covering the whole active
+   rect. a frame with an empty active rect means the overlay is hidden. a
+   consumer falling behind misses frames, never parts of one; in delta mode
+   the next frame covers everything the dropped ones would have.
+
+   the fifo is opened, or the socket connected, for one consumer at a time:
+   its stream starts at a frame whose rects cover the whole active rect.
+   once it goes away, a half written frame is dropped with its pipe or
+   connection and we wait for the next consumer to open or listen. only a
+   second reader opening the fifo while the first still has it open shares
+   that stream and may start mid-frame; it can skip to the next magic, but
+   pixels can look like one too. */
+#define HEADLESS_FRAME_MAGIC 0x4f54484du
+
+struct headless_frame {
+  uint32_t magic;
+  uint32_t seq;
+  /* the size of mumble's canvas */
+  uint16_t width, height;
+  uint16_t active_x, active_y, active_w, active_h;
+  uint16_t n_rects;
+  uint16_t raw;
+};
+
+struct headless_rect {
+  uint16_t x, y, w, h;
+};
+
+/* streams frames to the fifo or unix socket named by OVERLAY_THING_OUTPUT
+   instead of showing them. */
+extern const struct output_backend headless_output;
+
+#endif
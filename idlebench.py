@@ -0,0 +1,165 @@
+#!/usr/bin/env python3
+# drives overlay-thing through idle -> active -> idle against a fake mumble
+# and reports its rss and wakeups per second in each phase. frames go to a
+# fifo through the headless backend, so no X server is needed.
+#
+#   ./idlebench.py [./overlay-thing] [WIDTHxHEIGHT]
+
+import mmap
+import os
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+OVERLAY_MAGIC = 5
+MSG_INIT, MSG_SHMEM, MSG_BLIT, MSG_ACTIVE = 0, 1, 2, 3
+
+PHASE_SECONDS = 3.0
+SETTLE_SECONDS = 0.5
+BLIT_FPS = 60
+
+
+def msg(kind, body):
+    return struct.pack('IiI', OVERLAY_MAGIC, len(body), kind) + body
+
+
+def recv_exact(conn, n):
+    buf = b''
+    while len(buf) < n:
+        chunk = conn.recv(n - len(buf))
+        if not chunk:
+            raise EOFError('overlay-thing went away')
+        buf += chunk
+    return buf
+
+
+def recv_msg(conn):
+    _, length, kind = struct.unpack('IiI', recv_exact(conn, 12))
+    return kind, recv_exact(conn, length)
+
+
+def drain(read):
+    try:
+        while read():
+            pass
+    except OSError:
+        pass
+
+
+# reads from the fifo see end of file until overlay-thing has it open
+def drain_fifo(fd):
+    while True:
+        if not os.read(fd, 1 << 20):
+            time.sleep(0.01)
+
+
+def rss_kb(pid):
+    with open('/proc/%d/status' % pid) as f:
+        for line in f:
+            if line.startswith('VmRSS:'):
+                return int(line.split()[1])
+    return 0
+
+
+# every time a thread blocks and is woken up again counts as a voluntary
+# context switch, so their sum over all threads counts wakeups.
+def wakeups(pid):
+    total = 0
+    for tid in os.listdir('/proc/%d/task' % pid):
+        try:
+            with open('/proc/%d/task/%s/status' % (pid, tid)) as f:
+                for line in f:
+                    if line.startswith('voluntary_ctxt_switches:'):
+                        total += int(line.split()[1])
+        except FileNotFoundError:
+            pass
+    return total
+
+
+def measure(pid, seconds, tick=None):
+    start, t0 = wakeups(pid), time.monotonic()
+    while time.monotonic() - t0 < seconds:
+        if tick:
+            tick()
+        time.sleep(1.0 / BLIT_FPS)
+    elapsed = time.monotonic() - t0
+    return rss_kb(pid), (wakeups(pid) - start) / elapsed
+
+
+def main():
+    binary = sys.argv[1] if len(sys.argv) > 1 else './overlay-thing'
+    size = sys.argv[2] if len(sys.argv) > 2 else '1920x1080'
+    width, height = (int(v) for v in size.split('x'))
+    tmp = tempfile.mkdtemp(prefix='idlebench.')
+    pipe_path = os.path.join(tmp, 'MumbleOverlayPipe')
+    fifo_path = os.path.join(tmp, 'frames')
+    shm_name = '/idlebench-%d' % os.getpid()
+
+    listener = socket.socket(socket.AF_UNIX)
+    listener.bind(pipe_path)
+    listener.listen(1)
+    os.mkfifo(fifo_path)
+    fifo = os.open(fifo_path, os.O_RDONLY | os.O_NONBLOCK)
+    os.set_blocking(fifo, True)
+    threading.Thread(target=drain_fifo, args=(fifo,), daemon=True).start()
+
+    env = dict(os.environ, XDG_RUNTIME_DIR=tmp,
+               OVERLAY_THING_OUTPUT=fifo_path, OVERLAY_THING_SIZE=size)
+    env.pop('OVERLAY_THING_SOURCES', None)
+    proc = subprocess.Popen([binary], env=env, stdout=subprocess.DEVNULL)
+    shm_fd = -1
+    try:
+        listener.settimeout(10)
+        conn, _ = listener.accept()
+        kind, body = recv_msg(conn)
+        if kind != MSG_INIT:
+            raise RuntimeError('expected INIT, got %d' % kind)
+        width, height = struct.unpack('II', body)
+
+        shm_fd = os.open('/dev/shm' + shm_name,
+                         os.O_RDWR | os.O_CREAT | os.O_EXCL, 0o600)
+        os.ftruncate(shm_fd, width * height * 4)
+        shm = mmap.mmap(shm_fd, width * height * 4)
+        shm[:] = b'\x80' * (width * height * 4)
+
+        threading.Thread(target=drain, args=(lambda: conn.recv(4096),),
+                         daemon=True).start()
+        conn.sendall(msg(MSG_SHMEM, shm_name.encode() + b'\0'))
+
+        full = struct.pack('IIII', 0, 0, width, height)
+        blit = lambda: conn.sendall(msg(MSG_BLIT, full))
+
+        time.sleep(SETTLE_SECONDS)
+        idle_rss, idle_wakeups = measure(proc.pid, PHASE_SECONDS)
+
+        conn.sendall(msg(MSG_ACTIVE, full))
+        active_rss, active_wakeups = measure(proc.pid, PHASE_SECONDS, blit)
+
+        conn.sendall(msg(MSG_ACTIVE, struct.pack('IIII', 0, 0, 0, 0)))
+        time.sleep(SETTLE_SECONDS)
+        after_rss, after_wakeups = measure(proc.pid, PHASE_SECONDS)
+
+        print('%dx%d, %.0f s per phase, blits at %d fps while active'
+              % (width, height, PHASE_SECONDS, BLIT_FPS))
+        print('%-8s %10s %12s' % ('phase', 'rss kB', 'wakeups/s'))
+        for name, rss, rate in (('idle', idle_rss, idle_wakeups),
+                                ('active', active_rss, active_wakeups),
+                                ('idle', after_rss, after_wakeups)):
+            print('%-8s %10d %12.1f' % (name, rss, rate))
+        print('rss given back going idle: %d kB' % (active_rss - after_rss))
+    finally:
+        proc.terminate()
+        proc.wait()
+        if shm_fd != -1:
+            os.unlink('/dev/shm' + shm_name)
+        os.unlink(pipe_path)
+        os.unlink(fifo_path)
+        os.rmdir(tmp)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,28 @@
+#include <errno.h>
+
+#include <unistd.h>
+
+#include "io.h"
+
+enum read_status read_n(int fd, size_t* filled, void* buf, size_t size) {
+  ssize_t ret;
+  if (*filled >= size)
+    return READ_DONE;
+
+  ret = read(fd, (char*) buf + *filled, size - *filled);
+  if (ret == -1) {
+    if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+      return READ_AGAIN;
+
+    return READ_ERROR;
+  } else if (ret == 0) {
+    errno = 0;
+    return READ_EOF;
+  }
+
+  *filled += (size_t) ret;
+  if (*filled == size)
+    return READ_DONE;
+
+  return READ_AGAIN;
+}
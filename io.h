@@ -0,0 +1,17 @@
+#ifndef OVERLAY_APP_IO_H
+#define OVERLAY_APP_IO_H
+
+#include <stddef.h>
+
+enum read_status {
+  READ_DONE,
+  READ_EOF,
+  READ_ERROR,
+  READ_AGAIN
+};
+
+/* reads into buf until *filled reaches size, across as many calls as the
+   non-blocking fd needs; *filled carries the progress between calls. */
+enum read_status read_n(int fd, size_t* filled, void* buf, size_t size);
+
+#endif
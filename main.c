@@ -1,6 +1,7 @@
 #define _POSIX_SOURCE /* for sigsetops */
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <errno.h>
 #include <signal.h>
 
@@ -8,21 +9,29 @@
 
 #include <sys/epoll.h>
 #include <sys/signalfd.h>
+#include <sys/timerfd.h>
 
 #include "main.h"
 #include "mumble.h"
 #include "xcb.h"
+#include "headless.h"
 
-static int on_sig_read(struct app_state* state, uint32_t events);
+static int on_sig_read(struct app_state* state, uint32_t events,
+                       void* data);
 
 int main(void) {
   struct app_state state;
   sigset_t sigs;
   struct epoll_event event;
   my_epoll_cb sig_cb;
+  const char* scale_env;
 
-  state.sig_fd = state.mumble_pipe_fd = state.mumble_wait_fd = -1;
-  state.mumble_shm_ptr = state.xcb = NULL;
+  state.sig_fd = state.mumble_fps_fd = -1;
+  state.mumble_shm_ptr = state.canvas = state.xcb = NULL;
+  state.n_sources = 0;
+  state.pool = NULL;
+  state.headless = NULL;
+  state.wakeups = 0;
 
   state.home = getenv("XDG_RUNTIME_DIR");
   if (!state.home) {
@@ -30,12 +39,29 @@ int main(void) {
     return -1;
   }
 
+  state.scale = 1;
+  if ((scale_env = getenv("OVERLAY_THING_SCALE"))) {
+    char* end;
+    long scale = strtol(scale_env, &end, 10);
+    if (*end || scale < 1 || scale > OVERLAY_MAX_SCALE) {
+      fprintf(stderr, "OVERLAY_THING_SCALE must be between 1 and %d, "
+              "exiting\n", OVERLAY_MAX_SCALE);
+      return -1;
+    }
+    state.scale = (unsigned int) scale;
+  }
+
+  state.input_forwarding = getenv("OVERLAY_THING_FORWARD_INPUT") != NULL;
+
   if ((state.epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
     perror("epoll_create1");
     return -1;
   }
 
-  if (setup_xcb(&state) == -1) {
+  /* before mumble, whose damage tracking follows the output's */
+  state.output = getenv("OVERLAY_THING_OUTPUT") ? &headless_output
+                                                : &xcb_output;
+  if ((*state.output->setup)(&state) == -1) {
     /* TODO: how does x error checking work again */
     cleanup(&state);
     return -1;
@@ -64,9 +90,14 @@ int main(void) {
     return -1;
   }
 
+  /* only now, so the workers inherit the blocked SIGINT. without a pool
+     we just copy on one thread. */
+  state.pool = pool_create(POOL_MAX_THREADS);
+
   for (;;) {
     int ready = epoll_wait(state.epoll_fd, &event, 1, -1);
     my_epoll_cb cb;
+    ++state.wakeups;
     if (ready == -1) {
       if (errno == EINTR) {
         continue;
@@ -80,7 +111,7 @@ int main(void) {
     }
 
     cb = *(my_epoll_cb*) event.data.ptr;
-    if ((*cb)(&state, event.events) == -1)
+    if ((*cb)(&state, event.events, event.data.ptr) == -1)
       break;
   }
   sigprocmask(SIG_UNBLOCK, &sigs, NULL);
@@ -95,10 +126,42 @@ void cleanup(struct app_state* state) {
   if (state->sig_fd != -1)
     close(state->sig_fd);
   cleanup_mumble(state);
-  cleanup_xcb(state);
+  (*state->output->cleanup)(state);
+  pool_destroy(state->pool);
+  state->pool = NULL;
+}
+
+double timespec_sub(const struct timespec* a, const struct timespec* b) {
+  return (double) (a->tv_sec - b->tv_sec)
+         + (double) (a->tv_nsec - b->tv_nsec) / 1e9;
+}
+
+static void seconds_to_timespec(struct timespec* ts, double seconds) {
+  ts->tv_sec = (time_t) seconds;
+  ts->tv_nsec = (long) ((seconds - (double) ts->tv_sec) * 1e9);
+  /* all zeroes would disarm */
+  if (seconds > 0 && ts->tv_sec == 0 && ts->tv_nsec == 0)
+    ts->tv_nsec = 1;
+}
+
+int arm_timerfd(int fd, double first, double interval) {
+  struct itimerspec its;
+
+  memset(&its, 0, sizeof its);
+  if (first > 0) {
+    seconds_to_timespec(&its.it_value, first);
+    seconds_to_timespec(&its.it_interval, interval);
+  }
+  if (timerfd_settime(fd, 0, &its, NULL) == -1) {
+    perror("timerfd_settime");
+    return -1;
+  }
+
+  return 0;
 }
 
-static int on_sig_read(struct app_state* state, uint32_t events) {
+static int on_sig_read(struct app_state* state, uint32_t events,
+                       void* data) {
   struct signalfd_siginfo info;
   ssize_t ret;
   sigset_t sigs;
@@ -1,31 +1,139 @@
 #ifndef OVERLAY_APP_MAIN_H
 #define OVERLAY_APP_MAIN_H
 
+#include <time.h>
+
+#include <sys/un.h>
+
 #include <xcb/xcb.h>
 
 #include "overlay.h"
+#include "pool.h"
+#include "damage.h"
 
 struct app_state;
-typedef int (*my_epoll_cb)(struct app_state*, uint32_t);
+struct headless_output;
+/* data is the epoll_event's data.ptr, i.e. where the callback was found */
+typedef int (*my_epoll_cb)(struct app_state*, uint32_t, void* data);
+
+/* where frames go, picked once at startup: an X window (xcb.c) or a stream
+   for some other program to read (headless.c). */
+struct output_backend {
+  int (*setup)(struct app_state* state);
+  void (*cleanup)(struct app_state* state);
+  /* the active rect changed */
+  void (*move_resize)(struct app_state* state);
+  /* presents, or at least takes care of, everything in state->damage */
+  void (*blit)(struct app_state* state);
+  /* the overlay went idle; drop whatever the next frame can rebuild */
+  void (*release_buffers)(struct app_state* state);
+  /* state->interactive changed */
+  void (*update_input)(struct app_state* state);
+  /* sends input held back for the next frame */
+  void (*flush_input)(struct app_state* state);
+};
+
+/* room for a handful of queued messages to mumble; we only ever send small
+   ones, so running out means mumble stopped reading. */
+#define MUMBLE_OUT_BUF_SIZE 4096
+
+/* largest factor OVERLAY_THING_SCALE may shrink mumble's canvas by */
+#define OVERLAY_MAX_SCALE 4
+
+/* how many overlay pipes OVERLAY_THING_SOURCES may list */
+#define OVERLAY_MAX_SOURCES 4
+
+/* one overlay pipe, i.e. one mumble. all of them draw on a canvas of the
+   same size; see mumble.c. */
+struct mumble_source {
+  char path[sizeof(((struct sockaddr_un*) 0)->sun_path)];
+  my_epoll_cb read_cb, wait_cb;
+  int pipe_fd;
+  int wait_fd;
+  int out_polling;
+  size_t out_len, out_written;
+  size_t msg_read;
+  void* shm_ptr;
+  size_t shm_touched_lo, shm_touched_hi;
+  int interactive;
+  uint16_t active_x, active_y, active_w, active_h;
+  struct damage damage;
+  struct OverlayMsg msg;
+  char out_buf[MUMBLE_OUT_BUF_SIZE];
+};
 
 struct app_state {
+  const struct output_backend* output;
+  struct headless_output* headless;
   xcb_connection_t* xcb;
-  size_t mumble_msg_read;
+  /* what the output shows: the only source's shm, or canvas with all of
+     them composited. damage, the active rect and interactive describe
+     this, not any one source. */
   void* mumble_shm_ptr;
+  void* canvas;
+  /* areas to recomposite because sources came, went or moved */
+  struct damage stack_damage;
+  struct mumble_source sources[OVERLAY_MAX_SOURCES];
+  unsigned int n_sources;
   const char* home;
   xcb_gcontext_t gc;
   xcb_colormap_t cm;
   int epoll_fd;
   int sig_fd;
-  int mumble_pipe_fd;
-  int mumble_wait_fd;
+  int mumble_fps_fd;
+  unsigned long frames_presented, fps_last_frame;
+  float fps_sent;
+  struct timespec fps_last;
   xcb_window_t window;
+  int interactive;
+  /* OVERLAY_THING_FORWARD_INPUT: grab the keyboard too and send what we
+     grab to mumble as OVERLAY_MSGTYPE_INPUT */
+  int input_forwarding;
+  int input_grabbed;
+  int motion_pending;
+  int16_t motion_x, motion_y;
+  uint16_t motion_mods;
+  unsigned long motion_frame;
+  int input_latency_pending;
+  struct timespec input_sent;
+  int idle;
+  unsigned long wakeups, idle_wakeups;
+  struct timespec idle_since;
+  size_t max_request_bytes;
+  /* set when the X server is across a network. uploads are then paced
+     (see xcb.c) and, with RENDER, sent at 1/upload_div resolution into
+     upload_pixmap and scaled up by the server. */
+  int remote_display;
+  int render_ok;
+  int upload_timer_fd;
+  unsigned int upload_div;
+  double upload_bps;
+  size_t frame_bytes;
+  int fence_pending;
+  unsigned int fence_seq;
+  struct timespec last_upload;
+  uint32_t render_format, window_pic, upload_pic;
+  xcb_pixmap_t upload_pixmap;
+  uint16_t upload_pixmap_w, upload_pixmap_h;
+  unsigned int upload_pixmap_div;
+  struct worker_pool* pool;
+  int swap_pixels;
+  void* upload_buf;
+  size_t upload_buf_size;
+  struct damage damage;
   uint16_t mumble_active_x, mumble_active_y, mumble_active_w, mumble_active_h;
   uint16_t screen_res_width;
   uint16_t screen_res_height;
-  struct OverlayMsg mumble_msg;
+  /* mumble renders at screen size / scale; active rect, damage and shm
+     are all in those units. */
+  unsigned int scale;
+  uint16_t mumble_width, mumble_height;
 };
 
 void cleanup(struct app_state* state);
+double timespec_sub(const struct timespec* a, const struct timespec* b);
+/* fires first seconds from now, then every interval seconds; interval 0
+   makes it one-shot and first 0 disarms it. */
+int arm_timerfd(int fd, double first, double interval);
 
 #endif
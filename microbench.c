@@ -0,0 +1,568 @@
+/* standalone timings for the hot loops, no X server or mumble needed.
+
+   every case is calibrated so one sample takes a few milliseconds, then
+   sampled repeatedly; we print the median and the median absolute
+   deviation relative to it. cases whose deviation stays above
+   BENCH_MAX_REL_MAD after a few retries are marked with a '~'. cycles are
+   time stamp counter ticks where the cpu has one.
+
+   before timing anything, each pixel kernel is run on an awkwardly sized
+   rect and compared against a plain scalar version, so a fast but wrong
+   kernel fails the run instead of posting a nice number. */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#else
+#define HAVE_TSC 0
+#endif
+
+#include "overlay.h"
+#include "pixels.h"
+#include "pool.h"
+#include "io.h"
+#include "damage.h"
+
+#define BENCH_SCREEN_W 3840
+#define BENCH_SCREEN_H 2160
+#define BENCH_SAMPLES 21
+#define BENCH_MIN_SAMPLE_NS 2e6
+#define BENCH_MAX_REL_MAD 0.03
+#define BENCH_RETRIES 3
+
+/* odd sizes, so the vector loops leave a scalar tail */
+#define CHECK_W 37
+#define CHECK_H 9
+#define CHECK_STRIDE 41
+
+#define PARSE_BATCH 256
+#define DAMAGE_BATCH 1024
+
+typedef void (*bench_fn)(void* arg);
+
+struct bench_result {
+  double ns, ticks, rel_mad;
+  int stable;
+};
+
+struct copy_case {
+  struct worker_pool* pool;
+  row_kernel kernel;
+  unsigned int scale, factor;
+  uint32_t* dst;
+  const uint32_t* src;
+  size_t w, h;
+};
+
+struct parse_case {
+  int rd, wr;
+  char msgs[PARSE_BATCH * (sizeof(struct OverlayMsgHeader)
+                           + sizeof(struct OverlayMsgBlit))];
+  struct OverlayMsg msg;
+};
+
+struct damage_case {
+  struct damage d;
+  struct damage_rect rects[DAMAGE_BATCH];
+};
+
+static const struct {
+  size_t w, h;
+} sizes[] = {
+  { 64, 64 },
+  { 256, 256 },
+  { 640, 480 },
+  { 1280, 720 },
+  { 1920, 1080 },
+  { 3840, 2160 }
+};
+
+static double now_ns(void);
+static double now_ticks(void);
+static int cmp_double(const void* a, const void* b);
+static double median(double* v, size_t n);
+static void measure(bench_fn fn, void* arg, struct bench_result* res);
+static void report(const char* name, const char* size, unsigned int threads,
+                   const struct bench_result* res, double units,
+                   const char* unit, double bytes);
+static uint32_t random_pixel(unsigned int* seed);
+static uint32_t ref_over(uint32_t s, uint32_t d);
+static uint32_t ref_box(const uint32_t* src, size_t src_stride,
+                        size_t bw, size_t bh);
+static int check_pixels(const char* name, const uint32_t* got,
+                        const uint32_t* want, size_t w, size_t h,
+                        size_t stride, unsigned int slack);
+static int check_kernels(struct worker_pool* pool);
+static void run_copy(void* arg);
+static void run_parse(void* arg);
+static void run_damage(void* arg);
+static void bench_copies(struct worker_pool* pool);
+static int bench_parse(void);
+static void bench_damage(void);
+
+int main(void) {
+  struct worker_pool* pool = pool_create(POOL_MAX_THREADS);
+
+  if (check_kernels(pool) == -1) {
+    pool_destroy(pool);
+    return 1;
+  }
+
+  printf("%-16s %-10s %3s %12s %10s %8s %7s\n",
+         "kernel", "size", "thr", "ns/iter", "cyc/unit", "GB/s", "mad%");
+  bench_copies(pool);
+  if (bench_parse() == -1) {
+    pool_destroy(pool);
+    return 1;
+  }
+  bench_damage();
+
+  pool_destroy(pool);
+  return 0;
+}
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+}
+
+static double now_ticks(void) {
+#if HAVE_TSC
+  return (double) __rdtsc();
+#else
+  return now_ns();
+#endif
+}
+
+static int cmp_double(const void* a, const void* b) {
+  double x = *(const double*) a, y = *(const double*) b;
+  return x < y ? -1 : x > y;
+}
+
+static double median(double* v, size_t n) {
+  qsort(v, n, sizeof *v, &cmp_double);
+  return n % 2 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+static void measure(bench_fn fn, void* arg, struct bench_result* res) {
+  double ns[BENCH_SAMPLES], ticks[BENCH_SAMPLES], dev[BENCH_SAMPLES];
+  unsigned long iters = 1, i;
+  int retry, s;
+
+  /* warm caches and page tables, then find an iteration count that makes
+     a sample long enough for the clock */
+  for (;;) {
+    double t0 = now_ns();
+    for (i = 0; i < iters; ++i)
+      (*fn)(arg);
+    if (now_ns() - t0 >= BENCH_MIN_SAMPLE_NS)
+      break;
+    iters *= 2;
+  }
+
+  res->stable = 0;
+  for (retry = 0; retry < BENCH_RETRIES && !res->stable; ++retry) {
+    double m;
+
+    for (s = 0; s < BENCH_SAMPLES; ++s) {
+      double t0 = now_ns(), c0 = now_ticks();
+      for (i = 0; i < iters; ++i)
+        (*fn)(arg);
+      ticks[s] = (now_ticks() - c0) / (double) iters;
+      ns[s] = (now_ns() - t0) / (double) iters;
+    }
+
+    res->ticks = median(ticks, BENCH_SAMPLES);
+    m = res->ns = median(ns, BENCH_SAMPLES);
+    for (s = 0; s < BENCH_SAMPLES; ++s)
+      dev[s] = ns[s] > m ? ns[s] - m : m - ns[s];
+    res->rel_mad = median(dev, BENCH_SAMPLES) / m;
+    res->stable = res->rel_mad <= BENCH_MAX_REL_MAD;
+  }
+}
+
+static void report(const char* name, const char* size, unsigned int threads,
+                   const struct bench_result* res, double units,
+                   const char* unit, double bytes) {
+  printf("%-16s %-10s %3u %12.1f %7.3f/%-2s %8.2f %6.2f%s\n",
+         name, size, threads, res->ns, res->ticks / units, unit,
+         bytes / res->ns, res->rel_mad * 100, res->stable ? "" : " ~");
+}
+
+/* premultiplied, with a good share of the clear and opaque ones the
+   kernels take shortcuts for */
+static uint32_t random_pixel(unsigned int* seed) {
+  uint32_t a, px;
+  unsigned int k;
+
+  *seed = *seed * 1103515245u + 12345u;
+  switch ((*seed >> 16) % 4) {
+  case 0:
+    return 0;
+  case 1:
+    a = 0xff;
+    break;
+  default:
+    a = (*seed >> 8) & 0xff;
+  }
+
+  px = a << 24;
+  for (k = 0; k < 24; k += 8) {
+    *seed = *seed * 1103515245u + 12345u;
+    px |= ((*seed >> 16) % (a + 1)) << k;
+  }
+  return px;
+}
+
+/* d * (255 - alpha) / 255 rounded to nearest, plus s */
+static uint32_t ref_over(uint32_t s, uint32_t d) {
+  uint32_t inv = 255 - (s >> 24), out = 0;
+  unsigned int k;
+
+  for (k = 0; k < 32; k += 8) {
+    uint32_t t = (((d >> k) & 0xff) * inv * 2 + 255) / 510 + ((s >> k) & 0xff);
+    out |= (t > 0xff ? 0xff : t) << k;
+  }
+  return out;
+}
+
+/* the rounded average of a bw x bh block, per channel */
+static uint32_t ref_box(const uint32_t* src, size_t src_stride,
+                        size_t bw, size_t bh) {
+  uint32_t out = 0;
+  size_t x, y, n = bw * bh;
+  unsigned int k;
+
+  for (k = 0; k < 32; k += 8) {
+    size_t sum = 0;
+    for (y = 0; y < bh; ++y)
+      for (x = 0; x < bw; ++x)
+        sum += (src[y * src_stride + x] >> k) & 0xff;
+    out |= (uint32_t) ((sum + n / 2) / n) << k;
+  }
+  return out;
+}
+
+/* every channel of got may come out up to slack above want, never below */
+static int check_pixels(const char* name, const uint32_t* got,
+                        const uint32_t* want, size_t w, size_t h,
+                        size_t stride, unsigned int slack) {
+  size_t x, y;
+  unsigned int k;
+
+  for (y = 0; y < h; ++y) {
+    for (x = 0; x < w; ++x) {
+      uint32_t g = got[y * stride + x], e = want[y * stride + x];
+      for (k = 0; k < 32; k += 8) {
+        unsigned int gc = (g >> k) & 0xff, ec = (e >> k) & 0xff;
+        if (gc < ec || gc > ec + slack) {
+          fprintf(stderr, "%s: pixel %zu,%zu is %08x, expected %08x\n",
+                  name, x, y, (unsigned int) g, (unsigned int) e);
+          return -1;
+        }
+      }
+    }
+  }
+  return 0;
+}
+
+static int check_kernels(struct worker_pool* pool) {
+  static uint32_t src[256 * 256], dst[256 * 256], want[256 * 256];
+  unsigned int seed = 1, scale, pass;
+  size_t x, y, i, px = (size_t) BENCH_SCREEN_W * BENCH_SCREEN_H;
+  uint32_t* big_src, * big_dst;
+  int ret = 0;
+
+  for (i = 0; i < sizeof src / sizeof *src; ++i)
+    src[i] = random_pixel(&seed);
+
+  for (y = 0; y < CHECK_H; ++y)
+    for (x = 0; x < CHECK_W; ++x)
+      want[y * CHECK_STRIDE + x] =
+          __builtin_bswap32(src[y * CHECK_STRIDE + x]);
+  copy_rows_bswap(dst, CHECK_STRIDE, src, CHECK_STRIDE, CHECK_W, CHECK_H);
+  if (check_pixels("copy_rows_bswap", dst, want, CHECK_W, CHECK_H,
+                   CHECK_STRIDE, 0) == -1)
+    return -1;
+
+  for (i = 0; i < sizeof dst / sizeof *dst; ++i)
+    dst[i] = want[i] = random_pixel(&seed);
+  for (y = 0; y < CHECK_H; ++y)
+    for (x = 0; x < CHECK_W; ++x)
+      want[y * CHECK_STRIDE + x] = ref_over(src[y * CHECK_STRIDE + x],
+                                            dst[y * CHECK_STRIDE + x]);
+  blend_over_rows(dst, CHECK_STRIDE, src, CHECK_STRIDE, CHECK_W, CHECK_H);
+  if (check_pixels("blend_over_rows", dst, want, CHECK_W, CHECK_H,
+                   CHECK_STRIDE, 0) == -1)
+    return -1;
+
+  /* and every alpha over every dst value, for the rounding; in whole rows
+     for the vector loop, then one pixel at a time for the scalar tail */
+  for (pass = 0; pass < 2; ++pass) {
+    for (y = 0; y < 256; ++y) {
+      for (x = 0; x < 256; ++x) {
+        i = y * 256 + x;
+        src[i] = (uint32_t) y << 24 | (uint32_t) (y / 2) << 8;
+        dst[i] = (uint32_t) (x * 0x01010101u);
+        want[i] = ref_over(src[i], dst[i]);
+      }
+    }
+    if (pass == 0)
+      blend_over_rows(dst, 256, src, 256, 256, 256);
+    else
+      for (i = 0; i < 256 * 256; ++i)
+        blend_over_rows(dst + i, 1, src + i, 1, 1, 1);
+    if (check_pixels("blend_over_rows", dst, want, 256, 256, 256, 0) == -1)
+      return -1;
+  }
+  for (i = 0; i < sizeof src / sizeof *src; ++i)
+    src[i] = random_pixel(&seed);
+
+  for (scale = 2; scale <= 4; ++scale) {
+    char name[32];
+    size_t stride = CHECK_STRIDE * scale;
+    for (y = 0; y < CHECK_H * scale; ++y)
+      for (x = 0; x < CHECK_W * scale; ++x)
+        want[y * stride + x] = src[y / scale * CHECK_STRIDE + x / scale];
+    upscale_nearest(dst, stride, src, CHECK_STRIDE, CHECK_W, CHECK_H, scale);
+    snprintf(name, sizeof name, "upscale_nearest %ux", scale);
+    if (check_pixels(name, dst, want, CHECK_W * scale, CHECK_H * scale,
+                     stride, 0) == -1)
+      return -1;
+  }
+
+  /* the 2x path may round up once more than the exact average */
+  for (scale = 2; scale <= 4; ++scale) {
+    char name[32];
+    size_t w = (CHECK_W + scale - 1) / scale, h = (CHECK_H + scale - 1) / scale;
+    for (y = 0; y < h; ++y) {
+      for (x = 0; x < w; ++x) {
+        size_t sx = x * scale, sy = y * scale;
+        want[y * CHECK_STRIDE + x] =
+            ref_box(src + sy * CHECK_STRIDE + sx, CHECK_STRIDE,
+                    CHECK_W - sx < scale ? CHECK_W - sx : scale,
+                    CHECK_H - sy < scale ? CHECK_H - sy : scale);
+      }
+    }
+    downscale_box(dst, CHECK_STRIDE, src, CHECK_STRIDE, CHECK_W, CHECK_H,
+                  scale);
+    snprintf(name, sizeof name, "downscale_box %ux", scale);
+    if (check_pixels(name, dst, want, w, h, CHECK_STRIDE,
+                     scale == 2 ? 1 : 0) == -1)
+      return -1;
+  }
+
+  /* big enough for the pool to split it, from an unaligned dst */
+  big_src = malloc(px * 4);
+  big_dst = malloc(px * 4);
+  if (!big_src || !big_dst) {
+    fputs("out of memory\n", stderr);
+    exit(1);
+  }
+  for (i = 0; i < px; ++i)
+    big_src[i] = (uint32_t) i * 2654435761u;
+  convert_rows(pool, &copy_rows, big_dst + 3, BENCH_SCREEN_W,
+               big_src, BENCH_SCREEN_W, BENCH_SCREEN_W - 5,
+               BENCH_SCREEN_H - 1);
+  if (check_pixels("convert_rows", big_dst + 3, big_src, BENCH_SCREEN_W - 5,
+                   BENCH_SCREEN_H - 1, BENCH_SCREEN_W, 0) == -1)
+    ret = -1;
+
+  free(big_src);
+  free(big_dst);
+  return ret;
+}
+
+static void run_copy(void* arg) {
+  struct copy_case* c = arg;
+  if (c->factor > 1)
+    downscale_box(c->dst, c->w / c->factor, c->src, BENCH_SCREEN_W,
+                  c->w, c->h, c->factor);
+  else if (c->scale > 1)
+    upscale_rows(c->pool, c->dst, c->w, c->src, BENCH_SCREEN_W,
+                 c->w / c->scale, c->h / c->scale, c->scale);
+  else
+    convert_rows(c->pool, c->kernel, c->dst, c->w,
+                 c->src, BENCH_SCREEN_W, c->w, c->h);
+}
+
+/* mirrors on_mumble_read(): a header, then the body it announces */
+static void run_parse(void* arg) {
+  struct parse_case* c = arg;
+  size_t filled, msgsize, off = 0;
+  int n;
+
+  while (off < sizeof c->msgs) {
+    ssize_t ret = write(c->wr, c->msgs + off, sizeof c->msgs - off);
+    if (ret == -1) {
+      perror("write");
+      exit(1);
+    }
+    off += (size_t) ret;
+  }
+
+  for (n = 0; n < PARSE_BATCH; ++n) {
+    filled = 0;
+    if (read_n(c->rd, &filled, &c->msg,
+               sizeof(struct OverlayMsgHeader)) != READ_DONE)
+      abort();
+    msgsize = sizeof(struct OverlayMsgHeader) + (size_t) c->msg.omh.iLength;
+    if (read_n(c->rd, &filled, &c->msg, msgsize) != READ_DONE)
+      abort();
+  }
+}
+
+static void run_damage(void* arg) {
+  struct damage_case* c = arg;
+  size_t i;
+
+  damage_clear(&c->d);
+  for (i = 0; i < DAMAGE_BATCH; ++i)
+    damage_add(&c->d, c->rects[i].x, c->rects[i].y,
+               c->rects[i].w, c->rects[i].h);
+}
+
+static void bench_copies(struct worker_pool* pool) {
+  struct copy_case c;
+  struct bench_result res;
+  uint32_t* src;
+  void* dst;
+  size_t i, px = (size_t) BENCH_SCREEN_W * BENCH_SCREEN_H;
+  char size[32];
+
+  src = malloc(px * 4);
+  if (!src || posix_memalign(&dst, PIXELS_CACHE_LINE, px * 4) != 0) {
+    fputs("out of memory\n", stderr);
+    exit(1);
+  }
+  for (i = 0; i < px; ++i)
+    src[i] = (uint32_t) i * 2654435761u;
+  c.src = src;
+  c.dst = dst;
+  c.factor = 1;
+
+  for (i = 0; i < sizeof sizes / sizeof *sizes; ++i) {
+    double pixels = (double) sizes[i].w * (double) sizes[i].h;
+    c.w = sizes[i].w;
+    c.h = sizes[i].h;
+    snprintf(size, sizeof size, "%zux%zu", c.w, c.h);
+
+    c.kernel = &copy_rows;
+    c.scale = 1;
+    c.pool = NULL;
+    measure(&run_copy, &c, &res);
+    report("copy_rows", size, 1, &res, pixels, "px", pixels * 4);
+
+    if (pool_size(pool) > 1) {
+      c.pool = pool;
+      measure(&run_copy, &c, &res);
+      report("copy_rows", size, pool_size(pool), &res, pixels, "px",
+             pixels * 4);
+    }
+
+    c.kernel = &copy_rows_bswap;
+    c.pool = NULL;
+    measure(&run_copy, &c, &res);
+    report("copy_rows_bswap", size, 1, &res, pixels, "px", pixels * 4);
+
+    /* random pixels, so the all-clear and all-opaque shortcuts rarely hit */
+    c.kernel = &blend_over_rows;
+    measure(&run_copy, &c, &res);
+    report("blend_over", size, 1, &res, pixels, "px", pixels * 4);
+
+    /* output size as above, from a canvas half or a quarter as wide */
+    for (c.scale = 2; c.scale <= 4; c.scale *= 2) {
+      char name[32];
+      if (c.w % c.scale || c.h % c.scale)
+        continue;
+      snprintf(name, sizeof name, "upscale_%ux", c.scale);
+      measure(&run_copy, &c, &res);
+      report(name, size, 1, &res, pixels, "px", pixels * 4);
+    }
+
+    /* the remote upload path: the whole size in, a quarter of it out */
+    c.scale = 1;
+    c.factor = 2;
+    measure(&run_copy, &c, &res);
+    report("downscale_2x", size, 1, &res, pixels, "px", pixels * 4);
+    c.factor = 1;
+  }
+
+  free(src);
+  free(dst);
+}
+
+static int bench_parse(void) {
+  static struct parse_case c;
+  struct bench_result res;
+  struct OverlayMsgHeader omh;
+  struct OverlayMsgBlit omb;
+  int fds[2], n;
+  char* p = c.msgs;
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+    perror("socketpair");
+    return -1;
+  }
+  c.rd = fds[0];
+  c.wr = fds[1];
+  if (fcntl(c.rd, F_SETFL, O_NONBLOCK) == -1) {
+    perror("fcntl");
+    return -1;
+  }
+
+  omh.uiMagic = OVERLAY_MAGIC_NUMBER;
+  omh.uiType = OVERLAY_MSGTYPE_BLIT;
+  omh.iLength = sizeof omb;
+  for (n = 0; n < PARSE_BATCH; ++n) {
+    omb.x = (unsigned int) n;
+    omb.y = (unsigned int) n * 2;
+    omb.w = omb.h = 64;
+    memcpy(p, &omh, sizeof omh);
+    memcpy(p + sizeof omh, &omb, sizeof omb);
+    p += sizeof omh + sizeof omb;
+  }
+
+  measure(&run_parse, &c, &res);
+  report("read_n parse", "blit msg", 1, &res, PARSE_BATCH, "mg",
+         (double) sizeof c.msgs);
+
+  close(c.rd);
+  close(c.wr);
+  return 0;
+}
+
+static void bench_damage(void) {
+  static struct damage_case c;
+  struct bench_result res;
+  unsigned int seed = 1;
+  size_t i;
+
+  damage_init(&c.d, DAMAGE_MERGE_SLACK);
+  /* mostly small widget-sized updates scattered over the screen */
+  for (i = 0; i < DAMAGE_BATCH; ++i) {
+    seed = seed * 1103515245u + 12345u;
+    c.rects[i].x = (uint16_t) (seed >> 8) % (BENCH_SCREEN_W - 256);
+    seed = seed * 1103515245u + 12345u;
+    c.rects[i].y = (uint16_t) (seed >> 8) % (BENCH_SCREEN_H - 256);
+    seed = seed * 1103515245u + 12345u;
+    c.rects[i].w = (uint16_t) (16 + (seed >> 8) % 240);
+    seed = seed * 1103515245u + 12345u;
+    c.rects[i].h = (uint16_t) (16 + (seed >> 8) % 240);
+  }
+
+  measure(&run_damage, &c, &res);
+  report("damage_add", "random", 1, &res, DAMAGE_BATCH, "rc",
+         DAMAGE_BATCH * sizeof(struct damage_rect));
+}
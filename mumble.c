@@ -3,6 +3,7 @@
 #include <errno.h>
 #include <string.h>
 #include <assert.h>
+#include <stddef.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -10,6 +11,7 @@
 #include <sys/epoll.h>
 #include <sys/inotify.h>
 #include <sys/mman.h>
+#include <sys/timerfd.h>
 #include <linux/limits.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -17,74 +19,189 @@
 #define UNIX_PATH_MAX (sizeof(((struct sockaddr_un*) 0)->sun_path))
 
 #include "mumble.h"
-#include "xcb.h"
+#include "composite.h"
+#include "io.h"
 
 #define MUMBLE_PIPE_FILENAME "MumbleOverlayPipe"
 
-enum read_status {
-  READ_DONE,
-  READ_EOF,
-  READ_ERROR,
-  READ_AGAIN
-};
-
-static int inotify_init_watch_creates(const char* dir);
-static int on_mumble_wait_read(struct app_state* state, uint32_t events);
+/* the source whose callback member cb was registered with epoll */
+#define SOURCE_OF(cb, member) \
+  ((struct mumble_source*) ((char*) (cb) \
+                            - offsetof(struct mumble_source, member)))
+
+static int init_sources(struct app_state* state);
+static int open_source(struct app_state* state, struct mumble_source* src);
+static void cleanup_source(struct app_state* state,
+                           struct mumble_source* src);
+static const char* source_name(const struct mumble_source* src);
+static int inotify_init_watch_creates(const char* path);
+static int on_mumble_wait_read(struct app_state* state, uint32_t events,
+                               void* data);
 static int open_unix_socket(const char* path);
-static int send_mumble_init_msg(int sock, uint16_t width, uint16_t height);
+static int queue_mumble_msg(struct mumble_source* src, unsigned int type,
+                            const void* body, size_t len);
+static int flush_mumble_out(struct app_state* state,
+                            struct mumble_source* src);
+static int setup_fps_timer(struct app_state* state);
+static int on_fps_timer_read(struct app_state* state, uint32_t events,
+                             void* data);
+static int set_idle(struct app_state* state, int idle);
+static int update_active(struct app_state* state);
+static void update_interactive(struct app_state* state);
+static void sync_shm_ptr(struct app_state* state);
+static void present(struct app_state* state);
+static long read_rss_kb(void);
+static size_t mumble_shm_size(const struct app_state* state);
 static int get_mumble_pipe_path(char* buf, const char* home);
 static void inspect_msg(struct OverlayMsg* msg);
-static enum read_status read_n(int fd, size_t* filled, void* buf, size_t size);
 static void* open_mumble_shm(size_t mmap_size, const char* name);
-static int handle_mumble_msg(struct app_state* state);
-static int reopen_mumble(struct app_state* state);
-static int on_mumble_read(struct app_state* state, uint32_t events);
+static int handle_mumble_msg(struct app_state* state,
+                             struct mumble_source* src);
+static int reopen_source(struct app_state* state, struct mumble_source* src);
+static int on_mumble_read(struct app_state* state, uint32_t events,
+                          void* data);
 
-static my_epoll_cb mumble_cb = &on_mumble_read;
-static my_epoll_cb mumble_wait_cb = &on_mumble_wait_read;
+static my_epoll_cb fps_timer_cb = &on_fps_timer_read;
 
 int setup_mumble(struct app_state* state) {
-  struct epoll_event event;
+  unsigned int i;
 
-  if ((state->mumble_pipe_fd = open_unix_socket(state->home)) != -1) {
-    if (send_mumble_init_msg(state->mumble_pipe_fd,
-                             state->screen_res_width,
-                             state->screen_res_height) == -1) {
-      perror("sending init msg");
+  if (init_sources(state) == -1)
+    return -1;
+
+  /* with a scale, mumble draws (and we read) a smaller canvas, which
+     blit() blows back up to screen size */
+  state->mumble_width = (uint16_t) (state->screen_res_width / state->scale);
+  state->mumble_height =
+    (uint16_t) (state->screen_res_height / state->scale);
+  state->mumble_active_x =
+    state->mumble_active_y =
+    state->mumble_active_w =
+    state->mumble_active_h = 0;
+  state->interactive = 0;
+  state->canvas = NULL;
+  /* damage ends up in state->damage, so it mustn't be merged any more
+     eagerly than the output asked for there */
+  damage_init(&state->stack_damage, state->damage.merge_slack);
+  sync_shm_ptr(state);
+
+  if (setup_fps_timer(state) == -1)
+    return -1;
+
+  for (i = 0; i < state->n_sources; ++i)
+    if (open_source(state, &state->sources[i]) == -1)
       return -1;
+
+  return 0;
+}
+
+/* OVERLAY_THING_SOURCES lists overlay pipes separated by colons, bottom
+   one first; by default there's just mumble's usual one. */
+static int init_sources(struct app_state* state) {
+  const char* list = getenv("OVERLAY_THING_SOURCES");
+  const char* p = list;
+
+  state->n_sources = 0;
+  for (;;) {
+    struct mumble_source* src;
+    size_t len = 0;
+
+    if (list) {
+      len = strcspn(p, ":");
+      if (len == 0) {
+        fputs("empty path in OVERLAY_THING_SOURCES\n", stderr);
+        return -1;
+      }
     }
 
-    if (fcntl(state->mumble_pipe_fd, F_SETFL, O_NONBLOCK, 1) == -1) {
+    if (state->n_sources == OVERLAY_MAX_SOURCES) {
+      fprintf(stderr, "OVERLAY_THING_SOURCES lists more than %d pipes\n",
+              OVERLAY_MAX_SOURCES);
+      return -1;
+    }
+    src = &state->sources[state->n_sources];
+    src->pipe_fd = src->wait_fd = -1;
+    src->shm_ptr = NULL;
+    src->read_cb = &on_mumble_read;
+    src->wait_cb = &on_mumble_wait_read;
+    src->active_x = src->active_y = src->active_w = src->active_h = 0;
+    src->interactive = 0;
+    damage_init(&src->damage, state->damage.merge_slack);
+    ++state->n_sources;
+
+    if (!list) {
+      if (get_mumble_pipe_path(src->path, state->home) == -1) {
+        perror("mumble socket path");
+        return -1;
+      }
+      return 0;
+    }
+
+    if (len >= sizeof src->path) {
+      fputs("path in OVERLAY_THING_SOURCES too long\n", stderr);
+      return -1;
+    }
+    memcpy(src->path, p, len);
+    src->path[len] = '\0';
+
+    if (!p[len])
+      return 0;
+    p += len + 1;
+  }
+}
+
+static int open_source(struct app_state* state, struct mumble_source* src) {
+  struct epoll_event event;
+
+  if ((src->pipe_fd = open_unix_socket(src->path)) != -1) {
+    struct OverlayMsgInit init;
+    struct OverlayMsgPid pid;
+
+    if (fcntl(src->pipe_fd, F_SETFL, O_NONBLOCK) == -1) {
       perror("fcntl");
       return -1;
     }
 
     event.events = EPOLLIN | EPOLLRDHUP;
-    event.data.ptr = &mumble_cb;
+    event.data.ptr = &src->read_cb;
     if (epoll_ctl(state->epoll_fd, EPOLL_CTL_ADD,
-                  state->mumble_pipe_fd, &event) == -1) {
+                  src->pipe_fd, &event) == -1) {
       perror("epoll_ctl (mumble)");
       return -1;
     }
 
-    state->mumble_msg_read = 0;
-    state->mumble_active_x =
-      state->mumble_active_y =
-      state->mumble_active_w =
-      state->mumble_active_h = 0;
+    src->out_polling = 0;
+    src->out_len = src->out_written = 0;
+    src->msg_read = 0;
+    src->interactive = 0;
+    src->active_x = src->active_y = src->active_w = src->active_h = 0;
+    damage_clear(&src->damage);
+
+    init.uiWidth = state->mumble_width;
+    init.uiHeight = state->mumble_height;
+    pid.pid = (unsigned int) getpid();
+    if (queue_mumble_msg(src, OVERLAY_MSGTYPE_INIT, &init, sizeof init) == -1
+        || queue_mumble_msg(src, OVERLAY_MSGTYPE_PID, &pid, sizeof pid) == -1
+        || flush_mumble_out(state, src) == -1) {
+      perror("sending init msg");
+      return -1;
+    }
+
+    /* so the newcomer hears our frame rate too */
+    state->fps_sent = -1.0f;
+
     return 0;
   } else {
     if (errno == ECONNREFUSED || errno == ENOENT) {
-      puts("can't find mumble socket, waiting until mumble starts...");
+      printf("can't find %s, waiting until mumble starts...\n", src->path);
 
-      if ((state->mumble_wait_fd =
-            inotify_init_watch_creates(state->home)) == -1)
+      if ((src->wait_fd = inotify_init_watch_creates(src->path)) == -1)
         return -1;
 
       event.events = EPOLLIN | EPOLLRDHUP;
-      event.data.ptr = &mumble_wait_cb;
+      event.data.ptr = &src->wait_cb;
       if (epoll_ctl(state->epoll_fd, EPOLL_CTL_ADD,
-                    state->mumble_wait_fd, &event) == -1) {
+                    src->wait_fd, &event) == -1) {
         perror("epoll_ctl (inotify)");
         return -1;
       }
@@ -97,11 +214,31 @@ int setup_mumble(struct app_state* state) {
   }
 }
 
-static int inotify_init_watch_creates(const char* dir) {
+/* the part of the socket path inotify reports */
+static const char* source_name(const struct mumble_source* src) {
+  const char* slash = strrchr(src->path, '/');
+  return slash ? slash + 1 : src->path;
+}
+
+/* watches the directory the socket at path will show up in */
+static int inotify_init_watch_creates(const char* path) {
+  char dir[UNIX_PATH_MAX];
+  const char* slash = strrchr(path, '/');
   int inotify;
 
-  if ((inotify = inotify_init()) == -1) {
-    perror("inotify_init");
+  if (!slash) {
+    strcpy(dir, ".");
+  } else if (slash == path) {
+    strcpy(dir, "/");
+  } else {
+    memcpy(dir, path, (size_t) (slash - path));
+    dir[slash - path] = '\0';
+  }
+
+  /* non-blocking: with other sources live, a read that finds nothing for
+     us must not stall the loop */
+  if ((inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) {
+    perror("inotify_init1");
     return -1;
   }
 
@@ -114,7 +251,9 @@ static int inotify_init_watch_creates(const char* dir) {
   return inotify;
 }
 
-static int on_mumble_wait_read(struct app_state* state, uint32_t events) {
+static int on_mumble_wait_read(struct app_state* state, uint32_t events,
+                               void* data) {
+  struct mumble_source* src = SOURCE_OF(data, wait_cb);
   ssize_t ret;
   struct inotify_event* event;
   /* NAME_MAX is like 255. inotify manpage suggests this size is enough to
@@ -128,22 +267,25 @@ static int on_mumble_wait_read(struct app_state* state, uint32_t events) {
 
   for (;;) {
     event = &u.first_event;
-    ret = read(state->mumble_wait_fd, event, sizeof u.buf);
+    ret = read(src->wait_fd, event, sizeof u.buf);
     if (ret < (ssize_t) sizeof *event) {
-      if (errno == EINTR)
+      if (ret == -1 && errno == EINTR)
         continue;
-      close(state->mumble_wait_fd);
-      state->mumble_wait_fd = -1;
+      /* none of the creates so far were our socket */
+      if (ret == -1 && errno == EAGAIN)
+        return 0;
+      close(src->wait_fd);
+      src->wait_fd = -1;
       return -1;
     }
 
     for (;;) {
       size_t chunk_size;
-      if (strcmp(MUMBLE_PIPE_FILENAME, event->name) == 0) {
-        close(state->mumble_wait_fd);
-        state->mumble_wait_fd = -1;
+      if (strcmp(source_name(src), event->name) == 0) {
+        close(src->wait_fd);
+        src->wait_fd = -1;
 
-        return setup_mumble(state);
+        return open_source(state, src);
       }
 
       chunk_size = sizeof *event + event->len;
@@ -151,7 +293,7 @@ static int on_mumble_wait_read(struct app_state* state, uint32_t events) {
         break;
 
       ret -= (ssize_t) chunk_size;
-      event += chunk_size;
+      event = (struct inotify_event*) ((char*) event + chunk_size);
     }
   }
   assert(0);
@@ -162,8 +304,7 @@ static int open_unix_socket(const char* path) {
   struct sockaddr_un addr;
 
   addr.sun_family = AF_UNIX;
-  if (get_mumble_pipe_path(addr.sun_path, path) == -1)
-    return -1;
+  strcpy(addr.sun_path, path);
 
   sock = socket(AF_UNIX, SOCK_STREAM, 0);
   if (sock == -1)
@@ -177,30 +318,312 @@ static int open_unix_socket(const char* path) {
   return sock;
 }
 
-static int send_mumble_init_msg(int sock, uint16_t width, uint16_t height) {
-  size_t msg_written, msgsize;
-  struct OverlayMsg msg;
-  ssize_t ret;
+static int queue_mumble_msg(struct mumble_source* src, unsigned int type,
+                            const void* body, size_t len) {
+  struct OverlayMsgHeader omh;
+  size_t msgsize = sizeof omh + len;
 
-  msg.omh.uiMagic = OVERLAY_MAGIC_NUMBER;
-  msg.omh.uiType = OVERLAY_MSGTYPE_INIT;
-  msg.omh.iLength = sizeof(struct OverlayMsgInit);
-  msg.body.omi.uiWidth = width;
-  msg.body.omi.uiHeight = height;
-
-  msgsize = sizeof(struct OverlayMsgHeader) + sizeof(struct OverlayMsgInit);
-  msg_written = 0;
-  while (msg_written < msgsize) {
-    ret = write(sock, &msg, msgsize - msg_written);
-    if ((ret == -1 && (errno != EAGAIN && errno != EINTR)) || ret == 0) {
-      close(sock);
+  if (src->out_len + msgsize > sizeof src->out_buf) {
+    /* drop whatever already made it onto the socket and try again */
+    memmove(src->out_buf, src->out_buf + src->out_written,
+            src->out_len - src->out_written);
+    src->out_len -= src->out_written;
+    src->out_written = 0;
+
+    if (src->out_len + msgsize > sizeof src->out_buf) {
+      errno = ENOBUFS;
       return -1;
     }
-    msg_written += (size_t) ret;
   }
+
+  omh.uiMagic = OVERLAY_MAGIC_NUMBER;
+  omh.iLength = (int) len;
+  omh.uiType = type;
+  memcpy(src->out_buf + src->out_len, &omh, sizeof omh);
+  memcpy(src->out_buf + src->out_len + sizeof omh, body, len);
+  src->out_len += msgsize;
+
+  return 0;
+}
+
+/* writes as much of the queue as the socket takes without blocking, and
+   only asks epoll for EPOLLOUT while something is left over. */
+static int flush_mumble_out(struct app_state* state,
+                            struct mumble_source* src) {
+  struct epoll_event event;
+  int want_out;
+
+  while (src->out_written < src->out_len) {
+    ssize_t ret = send(src->pipe_fd, src->out_buf + src->out_written,
+                       src->out_len - src->out_written, MSG_NOSIGNAL);
+    if (ret == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      return -1;
+    }
+    src->out_written += (size_t) ret;
+  }
+
+  if (src->out_written == src->out_len)
+    src->out_len = src->out_written = 0;
+
+  want_out = src->out_len != 0;
+  if (want_out != src->out_polling) {
+    event.events = EPOLLIN | EPOLLRDHUP | (want_out ? EPOLLOUT : 0);
+    event.data.ptr = &src->read_cb;
+    if (epoll_ctl(state->epoll_fd, EPOLL_CTL_MOD,
+                  src->pipe_fd, &event) == -1) {
+      perror("epoll_ctl (mumble)");
+      return -1;
+    }
+    src->out_polling = want_out;
+  }
+
+  return 0;
+}
+
+/* the timer starts out disarmed, it only runs while the overlay is shown */
+static int setup_fps_timer(struct app_state* state) {
+  struct epoll_event event;
+
+  state->mumble_fps_fd = timerfd_create(CLOCK_MONOTONIC,
+                                        TFD_NONBLOCK | TFD_CLOEXEC);
+  if (state->mumble_fps_fd == -1) {
+    perror("timerfd_create");
+    return -1;
+  }
+
+  event.events = EPOLLIN;
+  event.data.ptr = &fps_timer_cb;
+  if (epoll_ctl(state->epoll_fd, EPOLL_CTL_ADD,
+                state->mumble_fps_fd, &event) == -1) {
+    perror("epoll_ctl (timerfd)");
+    return -1;
+  }
+
+  state->fps_last_frame = state->frames_presented;
+  state->fps_sent = -1.0f;
+  clock_gettime(CLOCK_MONOTONIC, &state->fps_last);
+
+  state->idle = 1;
+  state->idle_since = state->fps_last;
+  state->idle_wakeups = state->wakeups;
+
+  return 0;
+}
+
+/* while nothing is shown we give back everything we can rebuild on the
+   next ACTIVE: the upload buffers and the canvas, our page table entries
+   for the parts of the shms we read (the contents stay in the shm objects)
+   and the fps timer, so an idle overlay only wakes up for mumble's
+   messages. */
+static int set_idle(struct app_state* state, int idle) {
+  struct timespec now;
+  unsigned int i;
+
+  if (idle == state->idle)
+    return 0;
+  state->idle = idle;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  if (arm_timerfd(state->mumble_fps_fd, idle ? 0 : OVERLAY_FPS_INTERVAL,
+                  OVERLAY_FPS_INTERVAL) == -1)
+    return -1;
+
+  if (idle) {
+    (*state->output->release_buffers)(state);
+    composite_release(state);
+
+    for (i = 0; i < state->n_sources; ++i) {
+      struct mumble_source* src = &state->sources[i];
+      /* the touched range comes from mumble's rects; never let it reach
+         past our mapping into whatever is mapped after it. the mapping
+         itself covers its last page whole. */
+      size_t page = (size_t) sysconf(_SC_PAGESIZE);
+      size_t lo = src->shm_touched_lo & ~(page - 1);
+      size_t hi = src->shm_touched_hi;
+      if (hi > mumble_shm_size(state))
+        hi = mumble_shm_size(state);
+      hi = (hi + page - 1) & ~(page - 1);
+      if (src->shm_ptr && lo < hi) {
+        if (madvise((char*) src->shm_ptr + lo, hi - lo, MADV_DONTNEED) == -1)
+          perror("madvise");
+      }
+      src->shm_touched_lo = src->shm_touched_hi = 0;
+    }
+
+    state->idle_since = now;
+    state->idle_wakeups = state->wakeups;
+    printf("idle, rss %ld kB\n", read_rss_kb());
+  } else {
+    printf("was idle for %.1f s, %lu wakeups\n",
+           timespec_sub(&now, &state->idle_since),
+           state->wakeups - state->idle_wakeups);
+
+    state->fps_last = now;
+    state->fps_last_frame = state->frames_presented;
+  }
+
+  return 0;
+}
+
+/* the output shows the bounding box of all sources' active rects. */
+static int update_active(struct app_state* state) {
+  unsigned int i, x0 = UINT16_MAX, y0 = UINT16_MAX, x1 = 0, y1 = 0;
+  uint16_t x = 0, y = 0, w = 0, h = 0;
+
+  for (i = 0; i < state->n_sources; ++i) {
+    const struct mumble_source* src = &state->sources[i];
+    if (src->active_w * src->active_h == 0)
+      continue;
+    if (src->active_x < x0)
+      x0 = src->active_x;
+    if (src->active_y < y0)
+      y0 = src->active_y;
+    if ((unsigned int) src->active_x + src->active_w > x1)
+      x1 = (unsigned int) src->active_x + src->active_w;
+    if ((unsigned int) src->active_y + src->active_h > y1)
+      y1 = (unsigned int) src->active_y + src->active_h;
+  }
+  if (x1 > x0 && y1 > y0) {
+    x = (uint16_t) x0;
+    y = (uint16_t) y0;
+    w = (uint16_t) (x1 - x0);
+    h = (uint16_t) (y1 - y0);
+  }
+
+  if (x == state->mumble_active_x && y == state->mumble_active_y
+      && w == state->mumble_active_w && h == state->mumble_active_h)
+    return 0;
+
+  state->mumble_active_x = x;
+  state->mumble_active_y = y;
+  state->mumble_active_w = w;
+  state->mumble_active_h = h;
+  (*state->output->move_resize)(state);
+  if (set_idle(state, w * h == 0) == -1)
+    return -1;
+  damage_add(&state->stack_damage, x, y, w, h);
+
+  return 0;
+}
+
+/* input goes to whichever sources want it */
+static void update_interactive(struct app_state* state) {
+  unsigned int i;
+
+  state->interactive = 0;
+  for (i = 0; i < state->n_sources; ++i)
+    state->interactive |= state->sources[i].interactive;
+  (*state->output->update_input)(state);
+}
+
+/* a single source is shown straight from its shm, more are composited */
+static void sync_shm_ptr(struct app_state* state) {
+  state->mumble_shm_ptr = state->n_sources == 1 ? state->sources[0].shm_ptr
+                                                : state->canvas;
+}
+
+static void present(struct app_state* state) {
+  composite(state);
+  (*state->output->blit)(state);
+}
+
+static long read_rss_kb(void) {
+  FILE* f;
+  long size, resident;
+
+  if (!(f = fopen("/proc/self/statm", "r")))
+    return -1;
+  if (fscanf(f, "%ld %ld", &size, &resident) != 2)
+    resident = -1;
+  fclose(f);
+
+  return resident == -1 ? -1 : resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static int on_fps_timer_read(struct app_state* state, uint32_t events,
+                             void* data) {
+  uint64_t expirations;
+  struct timespec now;
+  struct OverlayMsgFps fps;
+  unsigned int i;
+
+  if (read(state->mumble_fps_fd, &expirations, sizeof expirations) == -1) {
+    if (errno == EAGAIN || errno == EINTR)
+      return 0;
+    perror("read (timerfd)");
+    return -1;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  fps.fps = (float) ((double) (state->frames_presented - state->fps_last_frame)
+                     / timespec_sub(&now, &state->fps_last));
+  state->fps_last_frame = state->frames_presented;
+  state->fps_last = now;
+
+  /* motion held back for a frame that never came goes out now */
+  (*state->output->flush_input)(state);
+
+  /* mumble keeps the last value around, no need to repeat ourselves */
+  if (fps.fps == state->fps_sent)
+    return 0;
+  state->fps_sent = fps.fps;
+
+  for (i = 0; i < state->n_sources; ++i) {
+    struct mumble_source* src = &state->sources[i];
+    if (src->pipe_fd == -1)
+      continue;
+
+    /* a full queue just means this sample is lost, the next one will do */
+    if (queue_mumble_msg(src, OVERLAY_MSGTYPE_FPS, &fps, sizeof fps) == -1)
+      continue;
+
+    if (flush_mumble_out(state, src) == -1) {
+      perror("can't write mumble msg");
+      fprintf(stderr, "%s closed, reopening...\n", src->path);
+      if (reopen_source(state, src) == -1)
+        return -1;
+    }
+  }
+
   return 0;
 }
 
+/* x and y are relative to the output's active rect, i.e. the bounding box
+   of all sources; each source gets them relative to its own. */
+int send_mumble_input(struct app_state* state, unsigned int type,
+                      int16_t x, int16_t y, unsigned int detail,
+                      unsigned int mods) {
+  struct OverlayMsgInput input;
+  unsigned int i;
+  int sent = 0;
+
+  input.type = type;
+  input.detail = detail;
+  input.mods = mods;
+  for (i = 0; i < state->n_sources; ++i) {
+    struct mumble_source* src = &state->sources[i];
+    if (src->pipe_fd == -1 || !src->interactive)
+      continue;
+
+    input.x = x + state->mumble_active_x - src->active_x;
+    input.y = y + state->mumble_active_y - src->active_y;
+    if (queue_mumble_msg(src, OVERLAY_MSGTYPE_INPUT,
+                         &input, sizeof input) == -1)
+      continue;
+
+    /* errors surface on the read side as a hangup, which reopens the
+       socket */
+    if (flush_mumble_out(state, src) == 0)
+      sent = 1;
+  }
+
+  return sent ? 0 : -1;
+}
+
 static int get_mumble_pipe_path(char* buf, const char* home) {
   static const char FILENAME_BIT[] = "/" MUMBLE_PIPE_FILENAME;
   size_t len;
@@ -247,29 +670,6 @@ static void inspect_msg(struct OverlayMsg* msg) {
   }
 }
 
-static enum read_status read_n(int fd, size_t* filled, void* buf, size_t size) {
-  ssize_t ret;
-  if (*filled > size)
-    return READ_DONE;
-
-  ret = read(fd, (char*) buf + *filled, size - *filled);
-  if (ret == -1) {
-    if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
-      return READ_AGAIN;
-
-    return READ_ERROR;
-  } else if (ret == 0) {
-    errno = 0;
-    return READ_EOF;
-  }
-
-  *filled += (size_t) ret;
-  if (*filled == size)
-    return READ_DONE;
-
-  return READ_AGAIN;
-}
-
 static void* open_mumble_shm(size_t mmap_size, const char* name) {
   int fd;
   void* ptr;
@@ -294,39 +694,50 @@ static void* open_mumble_shm(size_t mmap_size, const char* name) {
   return ptr;
 }
 
-static int handle_mumble_msg(struct app_state* state) {
-  switch (state->mumble_msg.omh.uiType) {
+static int handle_mumble_msg(struct app_state* state,
+                             struct mumble_source* src) {
+  switch (src->msg.omh.uiType) {
     case OVERLAY_MSGTYPE_INIT:
       break;
     case OVERLAY_MSGTYPE_SHMEM: {
-      size_t mmap_size =
-          (size_t) 4 * state->screen_res_width * state->screen_res_height;
-      if (state->mumble_shm_ptr)
-        munmap(state->mumble_shm_ptr, mmap_size);
-      state->mumble_shm_ptr =
-          open_mumble_shm(mmap_size, state->mumble_msg.body.oms.a_cName);
-      if (state->mumble_shm_ptr == NULL) {
+      size_t mmap_size = mumble_shm_size(state);
+      if (src->shm_ptr)
+        munmap(src->shm_ptr, mmap_size);
+      src->shm_touched_lo = src->shm_touched_hi = 0;
+      src->shm_ptr = open_mumble_shm(mmap_size, src->msg.body.oms.a_cName);
+      sync_shm_ptr(state);
+      if (src->shm_ptr == NULL) {
         return -1;
       } else {
         return 0;
       }
     }
     case OVERLAY_MSGTYPE_BLIT:
-      blit(state);
+      /* uploaded once we've drained the socket, see on_mumble_read() */
+      damage_add(&src->damage,
+                 src->msg.body.omb.x, src->msg.body.omb.y,
+                 src->msg.body.omb.w, src->msg.body.omb.h);
       break;
     case OVERLAY_MSGTYPE_ACTIVE:
-      state->mumble_active_x = (uint16_t) state->mumble_msg.body.oma.x;
-      state->mumble_active_y = (uint16_t) state->mumble_msg.body.oma.y;
-      state->mumble_active_w = (uint16_t) state->mumble_msg.body.oma.w;
-      state->mumble_active_h = (uint16_t) state->mumble_msg.body.oma.h;
-      move_resize(state);
-      blit(state);
+      /* what was under the old rect and what's under the new one changes */
+      damage_add(&state->stack_damage, src->active_x, src->active_y,
+                 src->active_w, src->active_h);
+      src->active_x = (uint16_t) src->msg.body.oma.x;
+      src->active_y = (uint16_t) src->msg.body.oma.y;
+      src->active_w = (uint16_t) src->msg.body.oma.w;
+      src->active_h = (uint16_t) src->msg.body.oma.h;
+      damage_add(&state->stack_damage, src->active_x, src->active_y,
+                 src->active_w, src->active_h);
+      if (update_active(state) == -1)
+        return -1;
       break;
     case OVERLAY_MSGTYPE_PID:
       break;
     case OVERLAY_MSGTYPE_FPS:
       break;
     case OVERLAY_MSGTYPE_INTERACTIVE:
+      src->interactive = src->msg.body.omin.state != 0;
+      update_interactive(state);
       break;
     default:
       break;
@@ -335,66 +746,123 @@ static int handle_mumble_msg(struct app_state* state) {
 }
 
 void cleanup_mumble(struct app_state* state) {
-  if (state->mumble_pipe_fd != -1) {
-    close(state->mumble_pipe_fd);
-    state->mumble_pipe_fd = -1;
+  unsigned int i;
+
+  for (i = 0; i < state->n_sources; ++i)
+    cleanup_source(state, &state->sources[i]);
+  if (state->mumble_fps_fd != -1) {
+    close(state->mumble_fps_fd);
+    state->mumble_fps_fd = -1;
+  }
+  composite_release(state);
+}
+
+static void cleanup_source(struct app_state* state,
+                           struct mumble_source* src) {
+  if (src->pipe_fd != -1) {
+    close(src->pipe_fd);
+    src->pipe_fd = -1;
   }
-  if (state->mumble_wait_fd != -1) {
-    close(state->mumble_wait_fd);
-    state->mumble_wait_fd = -1;
+  if (src->wait_fd != -1) {
+    close(src->wait_fd);
+    src->wait_fd = -1;
   }
-  if (state->mumble_shm_ptr) {
-    size_t mmap_size =
-      (size_t) 4 * state->screen_res_width * state->screen_res_height;
-    munmap(state->mumble_shm_ptr, mmap_size);
-    state->mumble_shm_ptr = NULL;
+  if (src->shm_ptr) {
+    size_t mmap_size = mumble_shm_size(state);
+    munmap(src->shm_ptr, mmap_size);
+    src->shm_ptr = NULL;
+    sync_shm_ptr(state);
   }
 }
 
-static int reopen_mumble(struct app_state* state) {
-  state->mumble_active_w = state->mumble_active_h = 0;
-  if (state->xcb)
-    move_resize(state);
+/* remembers which part of the shm we paged in, for set_idle(). offset is
+   in pixels, w x h the rect starting there. a canvas of our own doesn't
+   count, only the sources' shms do. */
+void mark_shm_touched(struct app_state* state, size_t offset,
+                      size_t w, size_t h) {
+  if (state->n_sources == 1)
+    mark_source_touched(state, &state->sources[0], offset, w, h);
+}
+
+void mark_source_touched(struct app_state* state, struct mumble_source* src,
+                         size_t offset, size_t w, size_t h) {
+  size_t touched_hi = 4 * (offset + (h - 1) * state->mumble_width + w);
+
+  if (src->shm_touched_hi == 0 || 4 * offset < src->shm_touched_lo)
+    src->shm_touched_lo = 4 * offset;
+  if (touched_hi > src->shm_touched_hi)
+    src->shm_touched_hi = touched_hi;
+}
+
+static size_t mumble_shm_size(const struct app_state* state) {
+  return (size_t) 4 * state->mumble_width * state->mumble_height;
+}
+
+/* the other sources carry on; what this one covered is recomposited
+   without it. */
+static int reopen_source(struct app_state* state, struct mumble_source* src) {
+  damage_add(&state->stack_damage, src->active_x, src->active_y,
+             src->active_w, src->active_h);
+  src->active_w = src->active_h = 0;
+  src->interactive = 0;
+  if (update_active(state) == -1)
+    return -1;
+  update_interactive(state);
 
-  cleanup_mumble(state);
-  return setup_mumble(state);
+  cleanup_source(state, src);
+  present(state);
+  return open_source(state, src);
 }
 
-static int on_mumble_read(struct app_state* state, uint32_t events) {
+static int on_mumble_read(struct app_state* state, uint32_t events,
+                          void* data) {
+  struct mumble_source* src = SOURCE_OF(data, read_cb);
+
+  if (events & EPOLLOUT) {
+    if (flush_mumble_out(state, src) == -1) {
+      perror("can't write mumble msg");
+      fprintf(stderr, "%s closed, reopening...\n", src->path);
+      return reopen_source(state, src);
+    }
+    if (!(events & ~(uint32_t) EPOLLOUT))
+      return 0;
+  }
+
   for (;;) {
     size_t msgsize;
-    switch (read_n(state->mumble_pipe_fd, &state->mumble_msg_read,
-                   &state->mumble_msg, sizeof(struct OverlayMsgHeader))) {
+    switch (read_n(src->pipe_fd, &src->msg_read,
+                   &src->msg, sizeof(struct OverlayMsgHeader))) {
       case READ_ERROR:
         perror("can't read mumble msg header");
         /* fall through */
       case READ_EOF:
-        fputs("mumble socket closed, reopening...\n", stderr);
-        return reopen_mumble(state);
+        fprintf(stderr, "%s closed, reopening...\n", src->path);
+        return reopen_source(state, src);
       case READ_AGAIN:
+        present(state);
         return 0;
       case READ_DONE:
         break;
     }
     msgsize = sizeof(struct OverlayMsgHeader)
-              + (size_t) state->mumble_msg.omh.iLength;
-    switch (read_n(state->mumble_pipe_fd, &state->mumble_msg_read,
-                   &state->mumble_msg, msgsize)) {
+              + (size_t) src->msg.omh.iLength;
+    switch (read_n(src->pipe_fd, &src->msg_read, &src->msg, msgsize)) {
       case READ_ERROR:
         perror("can't read mumble msg body");
         /* fall through */
       case READ_EOF:
-        fputs("mumble socket closed, reopening...\n", stderr);
-        return reopen_mumble(state);
+        fprintf(stderr, "%s closed, reopening...\n", src->path);
+        return reopen_source(state, src);
       case READ_AGAIN:
+        present(state);
         return 0;
       case READ_DONE:
         break;
     }
 
-    state->mumble_msg_read = 0;
-    inspect_msg(&state->mumble_msg);
-    if (handle_mumble_msg(state) == -1)
-      return reopen_mumble(state);
+    src->msg_read = 0;
+    inspect_msg(&src->msg);
+    if (handle_mumble_msg(state, src) == -1)
+      return reopen_source(state, src);
   }
 }
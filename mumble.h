@@ -3,7 +3,29 @@
 
 #include "main.h"
 
+/* not part of mumble's overlay protocol: pointer and key events we grabbed
+   while the overlay is interactive. type is the X event type, x/y are
+   relative to the overlay window, detail is the button or keycode and mods
+   the X modifier/button state. stock mumble skips message types it doesn't
+   know, so these are only sent with OVERLAY_THING_FORWARD_INPUT set, for a
+   mumble patched to handle them. */
+#define OVERLAY_MSGTYPE_INPUT 0x100
+struct OverlayMsgInput {
+  unsigned int type;
+  int x, y;
+  unsigned int detail;
+  unsigned int mods;
+};
+
 int setup_mumble(struct app_state* state);
 void cleanup_mumble(struct app_state* state);
 
+int send_mumble_input(struct app_state* state, unsigned int type,
+                      int16_t x, int16_t y, unsigned int detail,
+                      unsigned int mods);
+void mark_shm_touched(struct app_state* state, size_t offset,
+                      size_t w, size_t h);
+void mark_source_touched(struct app_state* state, struct mumble_source* src,
+                         size_t offset, size_t w, size_t h);
+
 #endif
@@ -0,0 +1,330 @@
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "pixels.h"
+
+struct row_job {
+  row_kernel kernel;
+  uint32_t* dst;
+  size_t dst_stride;
+  const uint32_t* src;
+  size_t src_stride;
+  size_t w, h;
+  unsigned int scale;
+  size_t rows_per_slice, lead_rows;
+};
+
+static void expand_row(uint32_t* dst, const uint32_t* src, size_t w,
+                       unsigned int scale);
+static size_t shrink_2x_row(uint32_t* dst, const uint32_t* s0,
+                            const uint32_t* s1, size_t src_w);
+static uint32_t over(uint32_t s, uint32_t d);
+static void split_rows(struct worker_pool* pool, struct row_job* job);
+static void run_row_slice(void* arg, unsigned int slice, unsigned int slices);
+
+void copy_rows(uint32_t* dst, size_t dst_stride,
+               const uint32_t* src, size_t src_stride,
+               size_t w, size_t h) {
+  size_t y;
+
+  if (dst_stride == w && src_stride == w) {
+    memcpy(dst, src, w * h * 4);
+    return;
+  }
+
+  for (y = 0; y < h; ++y)
+    memcpy(dst + y * dst_stride, src + y * src_stride, w * 4);
+}
+
+void copy_rows_bswap(uint32_t* dst, size_t dst_stride,
+                     const uint32_t* src, size_t src_stride,
+                     size_t w, size_t h) {
+  size_t x, y;
+
+  for (y = 0; y < h; ++y) {
+    uint32_t* d = dst + y * dst_stride;
+    const uint32_t* s = src + y * src_stride;
+    for (x = 0; x < w; ++x)
+      d[x] = __builtin_bswap32(s[x]);
+  }
+}
+
+void upscale_nearest(uint32_t* dst, size_t dst_stride,
+                     const uint32_t* src, size_t src_stride,
+                     size_t w, size_t h, unsigned int scale) {
+  size_t y;
+  unsigned int k;
+
+  for (y = 0; y < h; ++y) {
+    uint32_t* d = dst + y * scale * dst_stride;
+    expand_row(d, src + y * src_stride, w, scale);
+    for (k = 1; k < scale; ++k)
+      memcpy(d + k * dst_stride, d, w * scale * 4);
+  }
+}
+
+static void expand_row(uint32_t* dst, const uint32_t* src, size_t w,
+                       unsigned int scale) {
+  size_t x = 0;
+  unsigned int k;
+
+#ifdef __SSE2__
+  if (scale == 2) {
+    for (; x + 4 <= w; x += 4) {
+      __m128i v = _mm_loadu_si128((const __m128i*) (src + x));
+      _mm_storeu_si128((__m128i*) (dst + 2 * x), _mm_unpacklo_epi32(v, v));
+      _mm_storeu_si128((__m128i*) (dst + 2 * x + 4),
+                       _mm_unpackhi_epi32(v, v));
+    }
+  } else if (scale == 4) {
+    for (; x + 4 <= w; x += 4) {
+      __m128i v = _mm_loadu_si128((const __m128i*) (src + x));
+      _mm_storeu_si128((__m128i*) (dst + 4 * x),
+                       _mm_shuffle_epi32(v, 0x00));
+      _mm_storeu_si128((__m128i*) (dst + 4 * x + 4),
+                       _mm_shuffle_epi32(v, 0x55));
+      _mm_storeu_si128((__m128i*) (dst + 4 * x + 8),
+                       _mm_shuffle_epi32(v, 0xaa));
+      _mm_storeu_si128((__m128i*) (dst + 4 * x + 12),
+                       _mm_shuffle_epi32(v, 0xff));
+    }
+  }
+#endif
+
+  for (; x < w; ++x)
+    for (k = 0; k < scale; ++k)
+      dst[x * scale + k] = src[x];
+}
+
+void downscale_box(uint32_t* dst, size_t dst_stride,
+                   const uint32_t* src, size_t src_stride,
+                   size_t src_w, size_t src_h, unsigned int factor) {
+  size_t x, y, bx, by;
+
+  for (y = 0; y < src_h; y += factor) {
+    size_t bh = src_h - y < factor ? src_h - y : factor;
+    uint32_t* d = dst + (y / factor) * dst_stride;
+
+    x = 0;
+    if (factor == 2 && bh == 2)
+      x = shrink_2x_row(d, src + y * src_stride, src + (y + 1) * src_stride,
+                        src_w);
+
+    for (; x < src_w; x += factor) {
+      size_t bw = src_w - x < factor ? src_w - x : factor, n = bw * bh;
+      uint32_t sum[4] = { 0, 0, 0, 0 };
+
+      for (by = 0; by < bh; ++by) {
+        const uint32_t* s = src + (y + by) * src_stride + x;
+        for (bx = 0; bx < bw; ++bx) {
+          sum[0] += s[bx] & 0xff;
+          sum[1] += (s[bx] >> 8) & 0xff;
+          sum[2] += (s[bx] >> 16) & 0xff;
+          sum[3] += s[bx] >> 24;
+        }
+      }
+
+      d[x / factor] = (uint32_t) ((sum[0] + n / 2) / n)
+                      | (uint32_t) ((sum[1] + n / 2) / n) << 8
+                      | (uint32_t) ((sum[2] + n / 2) / n) << 16
+                      | (uint32_t) ((sum[3] + n / 2) / n) << 24;
+    }
+  }
+}
+
+/* 2x2 blocks of rows s0 and s1 as far as SSE2 gets; returns the source
+   column it stopped at. rounds up twice, so can come out one above the
+   exact average. */
+static size_t shrink_2x_row(uint32_t* dst, const uint32_t* s0,
+                            const uint32_t* s1, size_t src_w) {
+  size_t x = 0;
+
+#ifdef __SSE2__
+  for (; x + 8 <= src_w; x += 8) {
+    __m128 a = _mm_castsi128_ps(_mm_avg_epu8(
+        _mm_loadu_si128((const __m128i*) (s0 + x)),
+        _mm_loadu_si128((const __m128i*) (s1 + x))));
+    __m128 b = _mm_castsi128_ps(_mm_avg_epu8(
+        _mm_loadu_si128((const __m128i*) (s0 + x + 4)),
+        _mm_loadu_si128((const __m128i*) (s1 + x + 4))));
+    _mm_storeu_si128((__m128i*) (dst + x / 2), _mm_avg_epu8(
+        _mm_castps_si128(_mm_shuffle_ps(a, b, 0x88)),
+        _mm_castps_si128(_mm_shuffle_ps(a, b, 0xdd))));
+  }
+#else
+  (void) dst;
+  (void) s0;
+  (void) s1;
+  (void) src_w;
+#endif
+
+  return x;
+}
+
+void blend_over_rows(uint32_t* dst, size_t dst_stride,
+                     const uint32_t* src, size_t src_stride,
+                     size_t w, size_t h) {
+  size_t x, y;
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i ff = _mm_set1_epi32(0xff);
+  const __m128i round = _mm_set1_epi16(0x80);
+#endif
+
+  for (y = 0; y < h; ++y) {
+    uint32_t* d = dst + y * dst_stride;
+    const uint32_t* s = src + y * src_stride;
+
+    x = 0;
+#ifdef __SSE2__
+    for (; x + 4 <= w; x += 4) {
+      __m128i sv = _mm_loadu_si128((const __m128i*) (s + x));
+      __m128i a = _mm_srli_epi32(sv, 24), inv, inv_lo, inv_hi, lo, hi;
+      int opaque = _mm_movemask_epi8(_mm_cmpeq_epi32(a, ff));
+
+      /* overlays are mostly empty or solid, so skip the arithmetic */
+      if (_mm_movemask_epi8(_mm_cmpeq_epi32(a, zero)) == 0xffff
+          && _mm_movemask_epi8(_mm_cmpeq_epi32(sv, zero)) == 0xffff)
+        continue;
+      if (opaque == 0xffff) {
+        _mm_storeu_si128((__m128i*) (d + x), sv);
+        continue;
+      }
+
+      /* 255 - alpha in all four 16 bit lanes of each pixel */
+      inv = _mm_sub_epi32(ff, a);
+      inv = _mm_or_si128(inv, _mm_slli_epi32(inv, 16));
+      inv_lo = _mm_unpacklo_epi32(inv, inv);
+      inv_hi = _mm_unpackhi_epi32(inv, inv);
+
+      lo = _mm_loadu_si128((const __m128i*) (d + x));
+      hi = _mm_unpackhi_epi8(lo, zero);
+      lo = _mm_unpacklo_epi8(lo, zero);
+
+      /* d * inv / 255, rounded */
+      lo = _mm_add_epi16(_mm_mullo_epi16(lo, inv_lo), round);
+      hi = _mm_add_epi16(_mm_mullo_epi16(hi, inv_hi), round);
+      lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+      hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+
+      _mm_storeu_si128((__m128i*) (d + x),
+                       _mm_adds_epu8(_mm_packus_epi16(lo, hi), sv));
+    }
+#endif
+
+    for (; x < w; ++x)
+      d[x] = over(s[x], d[x]);
+  }
+}
+
+static uint32_t over(uint32_t s, uint32_t d) {
+  uint32_t inv = 255 - (s >> 24), out = 0;
+  unsigned int k;
+
+  for (k = 0; k < 32; k += 8) {
+    uint32_t t = ((d >> k) & 0xff) * inv + 0x80;
+    t = ((t + (t >> 8)) >> 8) + ((s >> k) & 0xff);
+    out |= (t > 0xff ? 0xff : t) << k;
+  }
+  return out;
+}
+
+void convert_rows(struct worker_pool* pool, row_kernel kernel,
+                  uint32_t* dst, size_t dst_stride,
+                  const uint32_t* src, size_t src_stride,
+                  size_t w, size_t h) {
+  struct row_job job;
+
+  job.kernel = kernel;
+  job.dst = dst;
+  job.dst_stride = dst_stride;
+  job.src = src;
+  job.src_stride = src_stride;
+  job.w = w;
+  job.h = h;
+  job.scale = 1;
+  split_rows(pool, &job);
+}
+
+void upscale_rows(struct worker_pool* pool,
+                  uint32_t* dst, size_t dst_stride,
+                  const uint32_t* src, size_t src_stride,
+                  size_t w, size_t h, unsigned int scale) {
+  struct row_job job;
+
+  job.kernel = NULL;
+  job.dst = dst;
+  job.dst_stride = dst_stride;
+  job.src = src;
+  job.src_stride = src_stride;
+  job.w = w;
+  job.h = h;
+  job.scale = scale;
+  split_rows(pool, &job);
+}
+
+static void split_rows(struct worker_pool* pool, struct row_job* job) {
+  size_t slices = pool_size(pool), row_bytes, align_rows, rows, lead;
+  size_t out_bytes = job->w * job->h * job->scale * job->scale * 4;
+
+  if (slices == 1 || out_bytes < PIXELS_MT_THRESHOLD) {
+    job->rows_per_slice = job->h;
+    job->lead_rows = 0;
+    run_row_slice(job, 0, 1);
+    return;
+  }
+
+  /* slices after the first start on a row whose first byte in dst is
+     cache line aligned, so neighbouring threads never write to the same
+     line. such rows come every align_rows rows from the first one, lead.
+     dst isn't always aligned itself (a rect inside a bigger canvas), and
+     if no row ever is, there's nothing to line up with. */
+  row_bytes = job->dst_stride * job->scale * 4;
+  align_rows = 1;
+  while ((align_rows * row_bytes) % PIXELS_CACHE_LINE != 0)
+    align_rows *= 2;
+  for (lead = 0; lead < align_rows; ++lead)
+    if ((uintptr_t) (job->dst + lead * job->scale * job->dst_stride)
+        % PIXELS_CACHE_LINE == 0)
+      break;
+  if (lead == align_rows) {
+    lead = 0;
+    align_rows = 1;
+  }
+
+  rows = (job->h + slices - 1) / slices;
+  rows = (rows + align_rows - 1) / align_rows * align_rows;
+
+  job->rows_per_slice = rows;
+  job->lead_rows = lead;
+  pool_run(pool, &run_row_slice, job);
+}
+
+static void run_row_slice(void* arg, unsigned int slice, unsigned int slices) {
+  struct row_job* job = arg;
+  size_t first = 0, end, rows;
+
+  (void) slices;
+  /* slice 0 also takes the rows before the first aligned one */
+  if (slice > 0)
+    first = (size_t) slice * job->rows_per_slice + job->lead_rows;
+  end = (size_t) (slice + 1) * job->rows_per_slice + job->lead_rows;
+  if (end > job->h)
+    end = job->h;
+  if (first >= end)
+    return;
+  rows = end - first;
+
+  if (job->scale > 1)
+    upscale_nearest(job->dst + first * job->scale * job->dst_stride,
+                    job->dst_stride,
+                    job->src + first * job->src_stride, job->src_stride,
+                    job->w, rows, job->scale);
+  else
+    (*job->kernel)(job->dst + first * job->dst_stride, job->dst_stride,
+                   job->src + first * job->src_stride, job->src_stride,
+                   job->w, rows);
+}
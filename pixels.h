@@ -0,0 +1,65 @@
+#ifndef OVERLAY_APP_PIXELS_H
+#define OVERLAY_APP_PIXELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pool.h"
+
+/* below this many bytes a copy isn't worth waking the other threads for */
+#define PIXELS_MT_THRESHOLD (2u << 20)
+
+/* convert_rows() and upscale_rows() start each thread's slice on a dst row
+   aligned to this, so threads don't write to the same cache line. when no
+   row of dst can be, like an unaligned dst whose stride is a multiple of
+   this, neighbouring slices share a line at their edge. */
+#define PIXELS_CACHE_LINE 64
+
+/* copies h rows of w pixels; strides are in pixels. */
+typedef void (*row_kernel)(uint32_t* dst, size_t dst_stride,
+                           const uint32_t* src, size_t src_stride,
+                           size_t w, size_t h);
+
+/* plain copy, for servers that take pixels in our byte order. */
+void copy_rows(uint32_t* dst, size_t dst_stride,
+               const uint32_t* src, size_t src_stride,
+               size_t w, size_t h);
+
+/* copy that byte-swaps every pixel, for servers of the other endianness. */
+void copy_rows_bswap(uint32_t* dst, size_t dst_stride,
+                     const uint32_t* src, size_t src_stride,
+                     size_t w, size_t h);
+
+/* blows every source pixel up into a scale x scale block; w and h count
+   source pixels, dst_stride destination pixels. */
+void upscale_nearest(uint32_t* dst, size_t dst_stride,
+                     const uint32_t* src, size_t src_stride,
+                     size_t w, size_t h, unsigned int scale);
+
+/* averages factor x factor blocks of src_w x src_h source pixels into one
+   destination pixel each. blocks cut off by the right or bottom edge
+   average what's there. fine for premultiplied pixels. factor 2 has an
+   SSE2 path that may round one step high. */
+void downscale_box(uint32_t* dst, size_t dst_stride,
+                   const uint32_t* src, size_t src_stride,
+                   size_t src_w, size_t src_h, unsigned int factor);
+
+/* draws premultiplied src over premultiplied dst. */
+void blend_over_rows(uint32_t* dst, size_t dst_stride,
+                     const uint32_t* src, size_t src_stride,
+                     size_t w, size_t h);
+
+/* runs kernel over the rows, split across pool if the copy is big enough.
+   pool may be NULL. */
+void convert_rows(struct worker_pool* pool, row_kernel kernel,
+                  uint32_t* dst, size_t dst_stride,
+                  const uint32_t* src, size_t src_stride,
+                  size_t w, size_t h);
+
+/* upscale_nearest(), split across pool like convert_rows(). */
+void upscale_rows(struct worker_pool* pool,
+                  uint32_t* dst, size_t dst_stride,
+                  const uint32_t* src, size_t src_stride,
+                  size_t w, size_t h, unsigned int scale);
+
+#endif
@@ -0,0 +1,193 @@
+#define _GNU_SOURCE /* for pthread_setaffinity_np */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <pthread.h>
+#include <sched.h>
+
+#include "pool.h"
+
+/* how long an idle worker busy-waits for the next job before it goes to
+   sleep on the condition variable. frames tend to come in bursts, so this
+   saves the wakeup latency on all but the first one. */
+#define POOL_SPIN_ITERATIONS 20000
+
+struct worker {
+  struct worker_pool* pool;
+  pthread_t thread;
+  unsigned int slice;
+};
+
+struct worker_pool {
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  unsigned int generation;
+  unsigned int sleepers;
+  unsigned int pending;
+  int quit;
+  pool_job_fn fn;
+  void* arg;
+  unsigned int n_workers;
+  struct worker workers[POOL_MAX_THREADS];
+};
+
+static void* worker_main(void* data);
+static void cpu_relax(void);
+static void pin_to_nth_cpu(pthread_t thread, const cpu_set_t* allowed,
+                           unsigned int n);
+
+struct worker_pool* pool_create(unsigned int max_threads) {
+  struct worker_pool* pool;
+  cpu_set_t allowed;
+  unsigned int i, cpus;
+
+  if (sched_getaffinity(0, sizeof allowed, &allowed) == -1) {
+    perror("sched_getaffinity");
+    return NULL;
+  }
+  cpus = (unsigned int) CPU_COUNT(&allowed);
+  if (max_threads > POOL_MAX_THREADS)
+    max_threads = POOL_MAX_THREADS;
+  if (cpus > max_threads)
+    cpus = max_threads;
+
+  if (!(pool = calloc(1, sizeof *pool))) {
+    perror("calloc");
+    return NULL;
+  }
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+
+  /* the calling thread does slice 0 itself */
+  for (i = 1; i < cpus; ++i) {
+    struct worker* w = &pool->workers[pool->n_workers];
+    w->pool = pool;
+    w->slice = i;
+    if (pthread_create(&w->thread, NULL, &worker_main, w) != 0) {
+      fputs("pthread_create failed, using fewer blit threads\n", stderr);
+      break;
+    }
+    pin_to_nth_cpu(w->thread, &allowed, i);
+    ++pool->n_workers;
+  }
+
+  return pool;
+}
+
+void pool_destroy(struct worker_pool* pool) {
+  unsigned int i;
+
+  if (!pool)
+    return;
+
+  pthread_mutex_lock(&pool->lock);
+  __atomic_store_n(&pool->quit, 1, __ATOMIC_SEQ_CST);
+  __atomic_add_fetch(&pool->generation, 1, __ATOMIC_SEQ_CST);
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (i = 0; i < pool->n_workers; ++i)
+    pthread_join(pool->workers[i].thread, NULL);
+
+  pthread_cond_destroy(&pool->wake);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool);
+}
+
+unsigned int pool_size(const struct worker_pool* pool) {
+  return pool ? pool->n_workers + 1 : 1;
+}
+
+void pool_run(struct worker_pool* pool, pool_job_fn fn, void* arg) {
+  unsigned int slices = pool_size(pool), spins = 0;
+
+  if (slices == 1) {
+    (*fn)(arg, 0, 1);
+    return;
+  }
+
+  pool->fn = fn;
+  pool->arg = arg;
+  __atomic_store_n(&pool->pending, pool->n_workers, __ATOMIC_SEQ_CST);
+  __atomic_add_fetch(&pool->generation, 1, __ATOMIC_SEQ_CST);
+
+  /* pairs with the sleepers/generation check in worker_main() */
+  if (__atomic_load_n(&pool->sleepers, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+  }
+
+  (*fn)(arg, 0, slices);
+
+  while (__atomic_load_n(&pool->pending, __ATOMIC_ACQUIRE)) {
+    if (++spins < POOL_SPIN_ITERATIONS)
+      cpu_relax();
+    else
+      sched_yield();
+  }
+}
+
+static void* worker_main(void* data) {
+  struct worker* w = data;
+  struct worker_pool* pool = w->pool;
+  unsigned int seen = 0;
+
+  for (;;) {
+    unsigned int gen, spins;
+
+    for (spins = 0; spins < POOL_SPIN_ITERATIONS; ++spins) {
+      if (__atomic_load_n(&pool->generation, __ATOMIC_ACQUIRE) != seen)
+        break;
+      cpu_relax();
+    }
+
+    gen = __atomic_load_n(&pool->generation, __ATOMIC_ACQUIRE);
+    if (gen == seen) {
+      pthread_mutex_lock(&pool->lock);
+      __atomic_add_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+      while ((gen = __atomic_load_n(&pool->generation, __ATOMIC_SEQ_CST))
+             == seen)
+        pthread_cond_wait(&pool->wake, &pool->lock);
+      __atomic_sub_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+      pthread_mutex_unlock(&pool->lock);
+    }
+    seen = gen;
+
+    if (__atomic_load_n(&pool->quit, __ATOMIC_ACQUIRE))
+      return NULL;
+
+    (*pool->fn)(pool->arg, w->slice, pool->n_workers + 1);
+    __atomic_sub_fetch(&pool->pending, 1, __ATOMIC_RELEASE);
+  }
+}
+
+static void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+/* spreads workers over the cpus we're allowed to run on, skipping the
+   first of that set. the main thread isn't pinned, so that one is only
+   left free for it, not reserved. */
+static void pin_to_nth_cpu(pthread_t thread, const cpu_set_t* allowed,
+                           unsigned int n) {
+  cpu_set_t one;
+  int cpu;
+
+  for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (!CPU_ISSET(cpu, allowed))
+      continue;
+    if (n-- == 0)
+      break;
+  }
+  if (cpu == CPU_SETSIZE)
+    return;
+
+  CPU_ZERO(&one);
+  CPU_SET(cpu, &one);
+  if (pthread_setaffinity_np(thread, sizeof one, &one) != 0)
+    fputs("couldn't pin blit thread, leaving it floating\n", stderr);
+}
@@ -0,0 +1,22 @@
+#ifndef OVERLAY_APP_POOL_H
+#define OVERLAY_APP_POOL_H
+
+/* caps how many cores one blit may occupy */
+#define POOL_MAX_THREADS 8
+
+/* called once per slice; slice 0 runs on the thread calling pool_run(). */
+typedef void (*pool_job_fn)(void* arg, unsigned int slice,
+                            unsigned int slices);
+
+struct worker_pool;
+
+struct worker_pool* pool_create(unsigned int max_threads);
+void pool_destroy(struct worker_pool* pool);
+
+/* number of slices pool_run() hands out, counting the caller. */
+unsigned int pool_size(const struct worker_pool* pool);
+
+/* runs fn on every slice and returns once all of them are done. */
+void pool_run(struct worker_pool* pool, pool_job_fn fn, void* arg);
+
+#endif
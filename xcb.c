@@ -3,20 +3,98 @@
 #include <assert.h>
 #include <string.h>
 
+#include <time.h>
+#include <errno.h>
+#include <malloc.h>
+
+#include <unistd.h>
 #include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
 
 #include <xcb/shape.h>
+#include <xcb/render.h>
 #include <xcb/bigreq.h>
+#include <xcb/xcbext.h>
 
 #include "xcb.h"
-
+#include "mumble.h"
+#include "pixels.h"
+
+#define INPUT_EVENT_MASK (XCB_EVENT_MASK_BUTTON_PRESS \
+                          | XCB_EVENT_MASK_BUTTON_RELEASE \
+                          | XCB_EVENT_MASK_POINTER_MOTION \
+                          | XCB_EVENT_MASK_KEY_PRESS \
+                          | XCB_EVENT_MASK_KEY_RELEASE)
+
+/* rows per PutImage when they're sent straight from the source; keeps the
+   iovec list well below IOV_MAX. */
+#define PUT_IMAGE_MAX_IOVECS 512
+
+/* pacing for remote displays: at most this many frames a second, one frame
+   in flight, and uploads shrunk by up to REMOTE_MAX_DIV in each direction
+   so that a full frame goes through in about REMOTE_FRAME_BUDGET seconds.
+   throughput is only estimated from frames of REMOTE_MIN_SAMPLE_BYTES or
+   more; while a frame is in flight we look for its reply every
+   REMOTE_FENCE_POLL seconds. */
+#define REMOTE_MAX_FPS 30
+#define REMOTE_FRAME_BUDGET 0.05
+#define REMOTE_MIN_SAMPLE_BYTES (64 * 1024)
+#define REMOTE_MAX_DIV 4
+#define REMOTE_FENCE_POLL 0.05
+
+static int setup_xcb(struct app_state* state);
+static void cleanup_xcb(struct app_state* state);
+static void move_resize(struct app_state* state);
+static void blit(struct app_state* state);
+static void release_upload_buffers(struct app_state* state);
+static void update_input(struct app_state* state);
+static void flush_input(struct app_state* state);
 static xcb_visualid_t get_rgba_visual(xcb_connection_t* c,
                                       xcb_screen_t* screen);
-static int on_xcb_read(struct app_state* state, uint32_t events);
+static int on_xcb_read(struct app_state* state, uint32_t events,
+                       void* data);
+static int grab_input(struct app_state* state);
+static void upload_rect(struct app_state* state,
+                        const struct damage_rect* r);
+static uint32_t* get_upload_buf(struct app_state* state, size_t size);
+static void put_image_rows(struct app_state* state, xcb_drawable_t drawable,
+                           const uint32_t* src, size_t stride,
+                           uint16_t w, uint16_t h,
+                           int16_t dst_x, int16_t dst_y);
+static int is_remote_display(xcb_connection_t* c);
+static int setup_remote(struct app_state* state, xcb_visualid_t visual);
+static xcb_render_pictformat_t get_visual_format(xcb_connection_t* c,
+                                                 xcb_visualid_t visual);
+static int on_upload_timer_read(struct app_state* state, uint32_t events,
+                                void* data);
+static int may_upload(struct app_state* state);
+static void send_fence(struct app_state* state);
+static void poll_fence(struct app_state* state);
+static void choose_upload_div(struct app_state* state);
+static int ensure_upload_pixmap(struct app_state* state);
+static void free_upload_pixmap(struct app_state* state);
+static void upload_rect_render(struct app_state* state,
+                               const struct damage_rect* r);
+static void forward_input(struct app_state* state, unsigned int type,
+                          int16_t x, int16_t y, unsigned int detail,
+                          unsigned int mods);
 
 static my_epoll_cb xcb_cb = &on_xcb_read;
-
-int setup_xcb(struct app_state* state) {
+static my_epoll_cb upload_timer_cb = &on_upload_timer_read;
+
+const struct output_backend xcb_output = {
+  &setup_xcb,
+  &cleanup_xcb,
+  &move_resize,
+  &blit,
+  &release_upload_buffers,
+  &update_input,
+  &flush_input
+};
+
+static int setup_xcb(struct app_state* state) {
   int i, screen_no = -1;
   xcb_screen_t* screen;
   xcb_screen_iterator_t iter;
@@ -27,6 +105,22 @@ int setup_xcb(struct app_state* state) {
   const xcb_query_extension_reply_t* ext_query;
 
   state->window = state->gc = state->cm = XCB_NONE;
+  state->frames_presented = 0;
+  state->interactive = state->input_grabbed = 0;
+  state->motion_pending = state->input_latency_pending = 0;
+  state->motion_frame = 0;
+  state->upload_buf = NULL;
+  state->upload_buf_size = 0;
+  damage_init(&state->damage, DAMAGE_MERGE_SLACK);
+  state->remote_display = state->render_ok = 0;
+  state->upload_timer_fd = -1;
+  state->upload_div = 1;
+  state->upload_bps = 0;
+  state->fence_pending = 0;
+  state->frame_bytes = 0;
+  state->last_upload.tv_sec = state->last_upload.tv_nsec = 0;
+  state->render_format = state->window_pic = state->upload_pic = XCB_NONE;
+  state->upload_pixmap = XCB_NONE;
   state->xcb = xcb_connect(NULL, &screen_no);
   if (!state->xcb) {
     fputs("Cannot open display\n", stderr);
@@ -34,6 +128,8 @@ int setup_xcb(struct app_state* state) {
   }
 
   xcb_big_requests_enable(state->xcb);
+  state->max_request_bytes =
+    (size_t) xcb_get_maximum_request_length(state->xcb) * 4;
 
   ext_query = xcb_get_extension_data(state->xcb, &xcb_shape_id);
   if (!ext_query->present) {
@@ -52,6 +148,14 @@ int setup_xcb(struct app_state* state) {
   }
   screen = iter.data;
 
+  /* mumble's shm holds native endian 0xAARRGGBB pixels */
+  state->swap_pixels = xcb_get_setup(state->xcb)->image_byte_order
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+                       != XCB_IMAGE_ORDER_LSB_FIRST;
+#else
+                       != XCB_IMAGE_ORDER_MSB_FIRST;
+#endif
+
   state->screen_res_width  = screen->width_in_pixels;
   state->screen_res_height = screen->height_in_pixels;
 
@@ -90,6 +194,12 @@ int setup_xcb(struct app_state* state) {
   xcb_shape_rectangles(state->xcb, XCB_SHAPE_SO_SET, XCB_SHAPE_SK_INPUT,
       XCB_CLIP_ORDERING_UNSORTED, state->window, 0, 0, 0, NULL);
 
+  if ((state->remote_display = is_remote_display(state->xcb))) {
+    puts("X display is remote, pacing uploads");
+    if (setup_remote(state, rgba_visual) == -1)
+      return -1;
+  }
+
   xcb_flush(state->xcb);
   event.events = EPOLLIN | EPOLLRDHUP;
   event.data.ptr = &xcb_cb;
@@ -103,8 +213,15 @@ int setup_xcb(struct app_state* state) {
 }
 
 
-void cleanup_xcb(struct app_state* state) {
+static void cleanup_xcb(struct app_state* state) {
+  if (state->upload_timer_fd != -1) {
+    close(state->upload_timer_fd);
+    state->upload_timer_fd = -1;
+  }
   if (state->xcb) {
+    free_upload_pixmap(state);
+    if (state->window_pic != XCB_NONE)
+      xcb_render_free_picture(state->xcb, state->window_pic);
     if (state->window != XCB_NONE)
       xcb_destroy_window(state->xcb, state->window);
     if (state->gc != XCB_NONE)
@@ -114,17 +231,18 @@ void cleanup_xcb(struct app_state* state) {
     xcb_disconnect(state->xcb);
     state->xcb = NULL;
   }
+  release_upload_buffers(state);
 }
 
-void move_resize(struct app_state* state) {
+static void move_resize(struct app_state* state) {
   uint32_t values[4];
   if (state->mumble_active_w * state->mumble_active_h > 0) {
     xcb_map_window(state->xcb, state->window);
 
-    values[0] = state->mumble_active_x;
-    values[1] = state->mumble_active_y;
-    values[2] = state->mumble_active_w;
-    values[3] = state->mumble_active_h;
+    values[0] = state->mumble_active_x * state->scale;
+    values[1] = state->mumble_active_y * state->scale;
+    values[2] = state->mumble_active_w * state->scale;
+    values[3] = state->mumble_active_h * state->scale;
 
     xcb_configure_window(state->xcb, state->window,
         XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y
@@ -132,39 +250,230 @@ void move_resize(struct app_state* state) {
         values);
   } else {
     xcb_unmap_window(state->xcb, state->window);
-    xcb_flush(state->xcb);
   }
+  update_input(state);
+}
+
+static void release_upload_buffers(struct app_state* state) {
+  if (state->upload_timer_fd != -1)
+    arm_timerfd(state->upload_timer_fd, 0, 0);
+  free_upload_pixmap(state);
+  free(state->upload_buf);
+  state->upload_buf = NULL;
+  state->upload_buf_size = 0;
+  /* the buffer is big enough to have been mmapped, but if it came out of
+     the heap, hand the top of it back too */
+  malloc_trim(0);
+}
+
+/* while mumble is interactive the input shape covers the whole window and
+   we hold the pointer grab, otherwise clicks go right through. only when
+   forwarding input do we also take the keyboard and listen to what we
+   grabbed; nothing else would deliver those keys anywhere. */
+static void update_input(struct app_state* state) {
+  xcb_rectangle_t rect;
+  uint32_t event_mask;
+  int grab = state->interactive
+             && state->mumble_active_w * state->mumble_active_h > 0;
+
+  rect.x = rect.y = 0;
+  rect.width = (uint16_t) (state->mumble_active_w * state->scale);
+  rect.height = (uint16_t) (state->mumble_active_h * state->scale);
+  xcb_shape_rectangles(state->xcb, XCB_SHAPE_SO_SET, XCB_SHAPE_SK_INPUT,
+      XCB_CLIP_ORDERING_UNSORTED, state->window, 0, 0,
+      grab ? 1 : 0, &rect);
+
+  event_mask = XCB_EVENT_MASK_EXPOSURE
+               | (grab && state->input_forwarding ? INPUT_EVENT_MASK : 0);
+  xcb_change_window_attributes(state->xcb, state->window,
+      XCB_CW_EVENT_MASK, &event_mask);
+
+  if (grab && !state->input_grabbed) {
+    state->input_grabbed = grab_input(state) == 0;
+  } else if (!grab && state->input_grabbed) {
+    xcb_ungrab_pointer(state->xcb, XCB_CURRENT_TIME);
+    if (state->input_forwarding)
+      xcb_ungrab_keyboard(state->xcb, XCB_CURRENT_TIME);
+    state->input_grabbed = 0;
+    state->motion_pending = 0;
+  }
+
+  xcb_flush(state->xcb);
+}
+
+/* sends the latest coalesced pointer position, if any. */
+static void flush_input(struct app_state* state) {
+  if (!state->motion_pending)
+    return;
+
+  state->motion_pending = 0;
+  state->motion_frame = state->frames_presented;
+  forward_input(state, XCB_MOTION_NOTIFY, state->motion_x, state->motion_y,
+                0, state->motion_mods);
 }
 
-void blit(struct app_state* state) {
-  size_t offset, size, y;
-  void* ptr;
-  void* buf;
+/* uploads whatever parts of the active rect have been damaged since the
+   last call. */
+static void blit(struct app_state* state) {
+  unsigned int i;
+
   if (!state->mumble_shm_ptr
-      || state->mumble_active_w * state->mumble_active_h == 0)
+      || state->mumble_active_w * state->mumble_active_h == 0) {
+    damage_clear(&state->damage);
+    return;
+  }
+
+  damage_clip(&state->damage,
+              state->mumble_active_x, state->mumble_active_y,
+              state->mumble_active_w, state->mumble_active_h);
+  if (state->damage.n == 0)
+    return;
+  /* the damage keeps until the upload timer calls us again */
+  if (state->remote_display && !may_upload(state))
     return;
-  offset = state->mumble_active_x +
-    (uint32_t) state->mumble_active_y * state->screen_res_width;
-  ptr = offset + (uint32_t*) state->mumble_shm_ptr;
-  size = (size_t) state->mumble_active_w * state->mumble_active_h * 4;
 
-  buf = malloc(size);
-  for (y = 0; y < state->mumble_active_h; ++y) {
-    memcpy((uint32_t*) buf + y * state->mumble_active_w,
-           (uint32_t*) ptr + y * state->screen_res_width,
-           (size_t) state->mumble_active_w * 4);
+  for (i = 0; i < state->damage.n; ++i)
+    upload_rect(state, &state->damage.rects[i]);
+  damage_clear(&state->damage);
+  ++state->frames_presented;
+  if (state->remote_display)
+    send_fence(state);
+
+  if (state->input_latency_pending) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    printf("input latency: %.2f ms\n",
+           timespec_sub(&now, &state->input_sent) * 1e3);
+    state->input_latency_pending = 0;
   }
 
-  xcb_put_image(state->xcb, XCB_IMAGE_FORMAT_Z_PIXMAP,
-      state->window, state->gc,
-      state->mumble_active_w, state->mumble_active_h,
-      0, 0, 0, 32,
-      (uint32_t) size, buf);
-  free(buf);
+  /* one motion event per frame */
+  flush_input(state);
 
   xcb_flush(state->xcb);
 }
 
+static void upload_rect(struct app_state* state,
+                        const struct damage_rect* r) {
+  size_t offset;
+  const uint32_t* ptr;
+  uint32_t* buf;
+  unsigned int s = state->scale;
+  uint16_t w = (uint16_t) (r->w * s), h = (uint16_t) (r->h * s);
+  int16_t dst_x = (int16_t) ((r->x - state->mumble_active_x) * s);
+  int16_t dst_y = (int16_t) ((r->y - state->mumble_active_y) * s);
+
+  if (state->render_ok && s * state->upload_div > 1) {
+    upload_rect_render(state, r);
+    return;
+  }
+
+  offset = r->x + (size_t) r->y * state->mumble_width;
+  ptr = offset + (const uint32_t*) state->mumble_shm_ptr;
+  mark_shm_touched(state, offset, r->w, r->h);
+
+  if (s == 1 && !state->swap_pixels) {
+    put_image_rows(state, state->window, ptr, state->mumble_width,
+                   w, h, dst_x, dst_y);
+    return;
+  }
+
+  if (!(buf = get_upload_buf(state, (size_t) w * h * 4)))
+    return;
+
+  if (s > 1) {
+    upscale_rows(state->pool, buf, w, ptr, state->mumble_width,
+                 r->w, r->h, s);
+    if (state->swap_pixels)
+      convert_rows(state->pool, &copy_rows_bswap, buf, w, buf, w, w, h);
+  } else {
+    convert_rows(state->pool, &copy_rows_bswap,
+                 buf, w, ptr, state->mumble_width, w, h);
+  }
+
+  put_image_rows(state, state->window, buf, w, w, h, dst_x, dst_y);
+}
+
+static uint32_t* get_upload_buf(struct app_state* state, size_t size) {
+  if (size > state->upload_buf_size) {
+    int err;
+    free(state->upload_buf);
+    state->upload_buf_size = 0;
+    err = posix_memalign(&state->upload_buf, PIXELS_CACHE_LINE, size);
+    if (err) {
+      state->upload_buf = NULL;
+      fprintf(stderr, "posix_memalign: %s\n", strerror(err));
+      return NULL;
+    }
+    state->upload_buf_size = size;
+  }
+  return state->upload_buf;
+}
+
+/* like xcb_put_image(), but takes the rows where they are instead of
+   wanting them in one contiguous block: each row becomes an iovec, or a
+   whole run of them if the stride is the width. requests are split to stay
+   under the server's maximum request length. xcb has written everything
+   out or copied it by the time this returns. */
+static void put_image_rows(struct app_state* state, xcb_drawable_t drawable,
+                           const uint32_t* src, size_t stride,
+                           uint16_t w, uint16_t h,
+                           int16_t dst_x, int16_t dst_y) {
+  xcb_protocol_request_t req;
+  xcb_put_image_request_t out;
+  /* xcb_send_request() needs two spare iovecs in front of the request */
+  struct iovec iov[2 + 1 + PUT_IMAGE_MAX_IOVECS];
+  size_t row_bytes = (size_t) w * 4, max_rows, y, chunk, i;
+  int contiguous = stride == w;
+
+  if (w == 0 || h == 0)
+    return;
+
+  max_rows = (state->max_request_bytes - sizeof out) / row_bytes;
+  if (!contiguous && max_rows > PUT_IMAGE_MAX_IOVECS)
+    max_rows = PUT_IMAGE_MAX_IOVECS;
+  if (max_rows == 0) {
+    fputs("overlay row doesn't fit in a request\n", stderr);
+    return;
+  }
+
+  req.ext = NULL;
+  req.opcode = XCB_PUT_IMAGE;
+  req.isvoid = 1;
+
+  memset(&out, 0, sizeof out);
+  out.format = XCB_IMAGE_FORMAT_Z_PIXMAP;
+  out.drawable = drawable;
+  out.gc = state->gc;
+  out.width = w;
+  out.dst_x = dst_x;
+  out.left_pad = 0;
+  out.depth = 32;
+
+  for (y = 0; y < h; y += chunk) {
+    chunk = h - y < max_rows ? h - y : max_rows;
+    out.height = (uint16_t) chunk;
+    out.dst_y = (int16_t) (dst_y + (int16_t) y);
+
+    iov[2].iov_base = &out;
+    iov[2].iov_len = sizeof out;
+    if (contiguous) {
+      iov[3].iov_base = (void*) (src + y * stride);
+      iov[3].iov_len = chunk * row_bytes;
+      req.count = 2;
+    } else {
+      for (i = 0; i < chunk; ++i) {
+        iov[3 + i].iov_base = (void*) (src + (y + i) * stride);
+        iov[3 + i].iov_len = row_bytes;
+      }
+      req.count = 1 + chunk;
+    }
+
+    xcb_send_request(state->xcb, 0, iov + 2, &req);
+    state->frame_bytes += sizeof out + chunk * row_bytes;
+  }
+}
+
 static xcb_visualid_t get_rgba_visual(xcb_connection_t* c,
                                       xcb_screen_t* screen) {
   xcb_depth_iterator_t depth_iter;
@@ -190,12 +499,70 @@ static xcb_visualid_t get_rgba_visual(xcb_connection_t* c,
   return XCB_NONE;
 }
 
-static int on_xcb_read(struct app_state* state, uint32_t events) {
+static int grab_input(struct app_state* state) {
+  xcb_grab_pointer_cookie_t pointer_cookie;
+  xcb_grab_keyboard_cookie_t keyboard_cookie;
+  xcb_grab_pointer_reply_t* pointer_reply;
+  xcb_grab_keyboard_reply_t* keyboard_reply = NULL;
+  int forwarding = state->input_forwarding, ok;
+
+  pointer_cookie = xcb_grab_pointer(state->xcb, 0, state->window,
+      forwarding ? XCB_EVENT_MASK_BUTTON_PRESS | XCB_EVENT_MASK_BUTTON_RELEASE
+                   | XCB_EVENT_MASK_POINTER_MOTION : 0,
+      XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC,
+      XCB_NONE, XCB_NONE, XCB_CURRENT_TIME);
+  if (forwarding)
+    keyboard_cookie = xcb_grab_keyboard(state->xcb, 0, state->window,
+        XCB_CURRENT_TIME, XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC);
+
+  pointer_reply = xcb_grab_pointer_reply(state->xcb, pointer_cookie, NULL);
+  if (forwarding)
+    keyboard_reply = xcb_grab_keyboard_reply(state->xcb, keyboard_cookie,
+                                             NULL);
+  ok = pointer_reply && pointer_reply->status == XCB_GRAB_STATUS_SUCCESS
+       && (!forwarding || (keyboard_reply
+           && keyboard_reply->status == XCB_GRAB_STATUS_SUCCESS));
+  free(pointer_reply);
+  free(keyboard_reply);
+
+  if (!ok) {
+    fputs("couldn't grab input for interactive mode\n", stderr);
+    xcb_ungrab_pointer(state->xcb, XCB_CURRENT_TIME);
+    if (forwarding)
+      xcb_ungrab_keyboard(state->xcb, XCB_CURRENT_TIME);
+    return -1;
+  }
+
+  return 0;
+}
+
+static void forward_input(struct app_state* state, unsigned int type,
+                          int16_t x, int16_t y, unsigned int detail,
+                          unsigned int mods) {
+  if (!state->input_forwarding)
+    return;
+
+  /* mumble thinks in canvas pixels */
+  x = (int16_t) (x / (int) state->scale);
+  y = (int16_t) (y / (int) state->scale);
+  if (send_mumble_input(state, type, x, y, detail, mods) == -1)
+    return;
+
+  /* time from the oldest unanswered input to the next frame we present */
+  if (!state->input_latency_pending) {
+    clock_gettime(CLOCK_MONOTONIC, &state->input_sent);
+    state->input_latency_pending = 1;
+  }
+}
+
+static int on_xcb_read(struct app_state* state, uint32_t events,
+                       void* data) {
   xcb_generic_event_t* event;
   int needs_blit = 0;
 
   while ((event = xcb_poll_for_event(state->xcb))) {
-    printf("XCB: %d\n", (int) event->response_type);
+    if ((event->response_type & ~0x80) != XCB_MOTION_NOTIFY)
+      printf("XCB: %d\n", (int) event->response_type);
     switch (event->response_type & ~0x80) {
     case 0: {
       /* xcb_request_error_t* error = (xcb_request_error_t*) event;
@@ -208,7 +575,38 @@ static int on_xcb_read(struct app_state* state, uint32_t events) {
       break;
     }
     case XCB_EXPOSE: {
-      /* xcb_expose_event_t* e = (xcb_expose_event_t*) event; */
+      xcb_expose_event_t* e = (xcb_expose_event_t*) event;
+      unsigned int s = state->scale;
+      damage_add(&state->damage,
+                 state->mumble_active_x + e->x / s,
+                 state->mumble_active_y + e->y / s,
+                 (e->x % s + e->width + s - 1) / s,
+                 (e->y % s + e->height + s - 1) / s);
+      needs_blit = 1;
+      break;
+    }
+    case XCB_MOTION_NOTIFY: {
+      xcb_motion_notify_event_t* e = (xcb_motion_notify_event_t*) event;
+      state->motion_x = e->event_x;
+      state->motion_y = e->event_y;
+      state->motion_mods = e->state;
+      state->motion_pending = 1;
+      break;
+    }
+    case XCB_BUTTON_PRESS:
+    case XCB_BUTTON_RELEASE: {
+      xcb_button_press_event_t* e = (xcb_button_press_event_t*) event;
+      flush_input(state);
+      forward_input(state, e->response_type & ~0x80, e->event_x, e->event_y,
+                    e->detail, e->state);
+      break;
+    }
+    case XCB_KEY_PRESS:
+    case XCB_KEY_RELEASE: {
+      xcb_key_press_event_t* e = (xcb_key_press_event_t*) event;
+      flush_input(state);
+      forward_input(state, e->response_type & ~0x80, e->event_x, e->event_y,
+                    e->detail, e->state);
       break;
     }
     default:
@@ -220,8 +618,336 @@ static int on_xcb_read(struct app_state* state, uint32_t events) {
   if (xcb_connection_has_error(state->xcb))
     return -1;
 
+  /* the reply to the last frame's fence may be what woke us */
+  if (state->fence_pending) {
+    poll_fence(state);
+    if (!state->fence_pending && state->damage.n)
+      needs_blit = 1;
+  }
+
   if (needs_blit)
     blit(state);
 
+  /* coalesced motion waits for the next frame unless one already went out
+     since the last motion we sent */
+  if (state->motion_pending && state->motion_frame != state->frames_presented)
+    flush_input(state);
+
   return 0;
 }
+
+/* ssh -X and friends hand us a TCP socket, a local server a unix one. */
+static int is_remote_display(xcb_connection_t* c) {
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof addr;
+
+  if (getsockname(xcb_get_file_descriptor(c),
+                  (struct sockaddr*) &addr, &len) == -1)
+    return 0;
+
+  return addr.ss_family != AF_UNIX;
+}
+
+/* over a slow link every byte counts more than a few extra requests, so
+   damage isn't merged unless that's free. uploads are paced by a timer, and
+   if RENDER is around we can shrink them and have the server scale them
+   back up. */
+static int setup_remote(struct app_state* state, xcb_visualid_t visual) {
+  struct epoll_event event;
+  xcb_render_query_version_reply_t* version;
+
+  state->damage.merge_slack = 0;
+
+  state->upload_timer_fd = timerfd_create(CLOCK_MONOTONIC,
+                                          TFD_NONBLOCK | TFD_CLOEXEC);
+  if (state->upload_timer_fd == -1) {
+    perror("timerfd_create");
+    return -1;
+  }
+
+  event.events = EPOLLIN;
+  event.data.ptr = &upload_timer_cb;
+  if (epoll_ctl(state->epoll_fd, EPOLL_CTL_ADD,
+                state->upload_timer_fd, &event) == -1) {
+    perror("epoll_ctl (upload timer)");
+    return -1;
+  }
+
+  if (!xcb_get_extension_data(state->xcb, &xcb_render_id)->present) {
+    fputs("no RENDER on the display, uploading at full resolution\n",
+          stderr);
+    return 0;
+  }
+
+  version = xcb_render_query_version_reply(state->xcb,
+      xcb_render_query_version(state->xcb, 0, 11), NULL);
+  if (!version)
+    return 0;
+  free(version);
+
+  state->render_format = get_visual_format(state->xcb, visual);
+  if (state->render_format == XCB_NONE)
+    return 0;
+
+  state->window_pic = xcb_generate_id(state->xcb);
+  xcb_render_create_picture(state->xcb, state->window_pic, state->window,
+      state->render_format, 0, NULL);
+  state->render_ok = 1;
+
+  return 0;
+}
+
+static xcb_render_pictformat_t get_visual_format(xcb_connection_t* c,
+                                                 xcb_visualid_t visual) {
+  xcb_render_query_pict_formats_reply_t* reply;
+  xcb_render_pictscreen_iterator_t screen_iter;
+  xcb_render_pictformat_t format = XCB_NONE;
+
+  reply = xcb_render_query_pict_formats_reply(c,
+      xcb_render_query_pict_formats(c), NULL);
+  if (!reply)
+    return XCB_NONE;
+
+  for (screen_iter = xcb_render_query_pict_formats_screens_iterator(reply);
+       screen_iter.rem && format == XCB_NONE;
+       xcb_render_pictscreen_next(&screen_iter)) {
+    xcb_render_pictdepth_iterator_t depth_iter;
+    for (depth_iter = xcb_render_pictscreen_depths_iterator(screen_iter.data);
+         depth_iter.rem && format == XCB_NONE;
+         xcb_render_pictdepth_next(&depth_iter)) {
+      xcb_render_pictvisual_iterator_t visual_iter;
+      for (visual_iter = xcb_render_pictdepth_visuals_iterator(depth_iter.data);
+           visual_iter.rem;
+           xcb_render_pictvisual_next(&visual_iter)) {
+        if (visual_iter.data->visual == visual) {
+          format = visual_iter.data->format;
+          break;
+        }
+      }
+    }
+  }
+
+  free(reply);
+  return format;
+}
+
+static int on_upload_timer_read(struct app_state* state, uint32_t events,
+                                void* data) {
+  uint64_t expirations;
+
+  if (read(state->upload_timer_fd, &expirations, sizeof expirations) == -1) {
+    if (errno == EAGAIN || errno == EINTR)
+      return 0;
+    perror("read (upload timer)");
+    return -1;
+  }
+
+  blit(state);
+  return 0;
+}
+
+/* on a remote display, a frame may go out once the last one has arrived
+   and the frame rate cap allows. otherwise the timer brings us back. */
+static int may_upload(struct app_state* state) {
+  struct timespec now;
+  double wait;
+
+  poll_fence(state);
+  if (state->fence_pending) {
+    arm_timerfd(state->upload_timer_fd, REMOTE_FENCE_POLL, 0);
+    return 0;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  wait = 1.0 / REMOTE_MAX_FPS - timespec_sub(&now, &state->last_upload);
+  if (wait > 0) {
+    arm_timerfd(state->upload_timer_fd, wait, 0);
+    return 0;
+  }
+
+  state->last_upload = now;
+  state->frame_bytes = 0;
+  return 1;
+}
+
+/* the reply to a GetInputFocus sent behind the frame tells us when the
+   server has got through all of it. */
+static void send_fence(struct app_state* state) {
+  state->fence_seq = xcb_get_input_focus(state->xcb).sequence;
+  state->fence_pending = 1;
+}
+
+static void poll_fence(struct app_state* state) {
+  void* reply;
+  xcb_generic_error_t* error;
+  struct timespec now;
+  double elapsed, bps;
+
+  if (!state->fence_pending
+      || !xcb_poll_for_reply(state->xcb, state->fence_seq, &reply, &error))
+    return;
+  free(reply);
+  free(error);
+  state->fence_pending = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  elapsed = timespec_sub(&now, &state->last_upload);
+  if (elapsed <= 0)
+    return;
+
+  /* a small frame mostly measures latency, which still puts a floor under
+     the throughput */
+  bps = (double) state->frame_bytes / elapsed;
+  if (state->frame_bytes < REMOTE_MIN_SAMPLE_BYTES && bps <= state->upload_bps)
+    return;
+
+  state->upload_bps = state->upload_bps > 0
+                      ? 0.7 * state->upload_bps + 0.3 * bps
+                      : bps;
+  if (state->render_ok)
+    choose_upload_div(state);
+}
+
+/* picks the smallest shrink factor at which a full active rect fits the
+   frame budget, and only grows back once it fits with room to spare. */
+static void choose_upload_div(struct app_state* state) {
+  double full = 4.0 * state->mumble_active_w * state->mumble_active_h;
+  unsigned int div = 1;
+
+  if (full == 0 || state->upload_bps <= 0)
+    return;
+
+  while (div < REMOTE_MAX_DIV
+         && full / ((double) div * div) / state->upload_bps
+            > REMOTE_FRAME_BUDGET)
+    div *= 2;
+
+  if (div < state->upload_div
+      && full / ((double) div * div) / state->upload_bps
+         > REMOTE_FRAME_BUDGET / 2)
+    return;
+  if (div == state->upload_div)
+    return;
+
+  state->upload_div = div;
+  printf("uploading at 1/%u resolution, %.2f MB/s\n",
+         div, state->upload_bps / 1e6);
+
+  /* everything on screen is at the old resolution */
+  damage_add(&state->damage,
+             state->mumble_active_x, state->mumble_active_y,
+             state->mumble_active_w, state->mumble_active_h);
+}
+
+/* a pixmap covering the active rect at 1/upload_div of mumble's
+   resolution, with a picture on it that scales to window pixels. */
+static int ensure_upload_pixmap(struct app_state* state) {
+  unsigned int d = state->upload_div, f = state->scale * d;
+  uint16_t w = (uint16_t) ((state->mumble_active_w + d - 1) / d);
+  uint16_t h = (uint16_t) ((state->mumble_active_h + d - 1) / d);
+  uint32_t repeat = XCB_RENDER_REPEAT_PAD;
+  xcb_render_transform_t transform;
+  /* nearest keeps a plain integer upscale exact, like the local path */
+  const char* filter = d > 1 ? "bilinear" : "nearest";
+
+  if (state->upload_pixmap != XCB_NONE
+      && state->upload_pixmap_w == w && state->upload_pixmap_h == h
+      && state->upload_pixmap_div == d)
+    return 0;
+
+  free_upload_pixmap(state);
+
+  state->upload_pixmap = xcb_generate_id(state->xcb);
+  xcb_create_pixmap(state->xcb, 32, state->upload_pixmap, state->window,
+      w, h);
+
+  state->upload_pic = xcb_generate_id(state->xcb);
+  xcb_render_create_picture(state->xcb, state->upload_pic,
+      state->upload_pixmap, state->render_format,
+      XCB_RENDER_CP_REPEAT, &repeat);
+
+  /* 16.16 fixed point, rounded: truncating 1/3 or 1/6 makes the sampling
+     drift further off the further right or down it gets */
+  memset(&transform, 0, sizeof transform);
+  transform.matrix11 = transform.matrix22 =
+      (xcb_render_fixed_t) ((65536 + f / 2) / f);
+  transform.matrix33 = 65536;
+  xcb_render_set_picture_transform(state->xcb, state->upload_pic, transform);
+  xcb_render_set_picture_filter(state->xcb, state->upload_pic,
+      (uint16_t) strlen(filter), filter, 0, NULL);
+
+  state->upload_pixmap_w = w;
+  state->upload_pixmap_h = h;
+  state->upload_pixmap_div = d;
+  return 0;
+}
+
+static void free_upload_pixmap(struct app_state* state) {
+  if (!state->xcb)
+    return;
+
+  if (state->upload_pic != XCB_NONE) {
+    xcb_render_free_picture(state->xcb, state->upload_pic);
+    state->upload_pic = XCB_NONE;
+  }
+  if (state->upload_pixmap != XCB_NONE) {
+    xcb_free_pixmap(state->xcb, state->upload_pixmap);
+    state->upload_pixmap = XCB_NONE;
+  }
+}
+
+/* shrinks the damaged part of mumble's canvas by upload_div, puts it into
+   the upload pixmap and lets the server scale it onto the window. */
+static void upload_rect_render(struct app_state* state,
+                               const struct damage_rect* r) {
+  unsigned int d = state->upload_div, f = state->scale * d;
+  unsigned int rx = r->x - state->mumble_active_x;
+  unsigned int ry = r->y - state->mumble_active_y;
+  uint16_t ux = (uint16_t) (rx / d), uy = (uint16_t) (ry / d), uw, uh;
+  size_t sw, sh, offset;
+  const uint32_t* src;
+  uint32_t* buf;
+
+  if (ensure_upload_pixmap(state) == -1)
+    return;
+
+  uw = (uint16_t) ((rx + r->w + d - 1) / d);
+  uh = (uint16_t) ((ry + r->h + d - 1) / d);
+  uw = (uint16_t) ((uw < state->upload_pixmap_w ? uw : state->upload_pixmap_w)
+                   - ux);
+  uh = (uint16_t) ((uh < state->upload_pixmap_h ? uh : state->upload_pixmap_h)
+                   - uy);
+  sw = (size_t) uw * d;
+  if (sw > state->mumble_active_w - (size_t) ux * d)
+    sw = state->mumble_active_w - (size_t) ux * d;
+  sh = (size_t) uh * d;
+  if (sh > state->mumble_active_h - (size_t) uy * d)
+    sh = state->mumble_active_h - (size_t) uy * d;
+
+  offset = state->mumble_active_x + (size_t) ux * d
+           + (state->mumble_active_y + (size_t) uy * d) * state->mumble_width;
+  src = offset + (const uint32_t*) state->mumble_shm_ptr;
+  mark_shm_touched(state, offset, sw, sh);
+
+  if (d == 1 && !state->swap_pixels) {
+    put_image_rows(state, state->upload_pixmap, src, state->mumble_width,
+                   uw, uh, (int16_t) ux, (int16_t) uy);
+  } else {
+    if (!(buf = get_upload_buf(state, (size_t) uw * uh * 4)))
+      return;
+    if (d > 1)
+      downscale_box(buf, uw, src, state->mumble_width, sw, sh, d);
+    else
+      copy_rows(buf, uw, src, state->mumble_width, uw, uh);
+    if (state->swap_pixels)
+      copy_rows_bswap(buf, uw, buf, uw, uw, uh);
+    put_image_rows(state, state->upload_pixmap, buf, uw,
+                   uw, uh, (int16_t) ux, (int16_t) uy);
+  }
+
+  xcb_render_composite(state->xcb, XCB_RENDER_PICT_OP_SRC,
+      state->upload_pic, XCB_NONE, state->window_pic,
+      (int16_t) (ux * f), (int16_t) (uy * f), 0, 0,
+      (int16_t) (ux * f), (int16_t) (uy * f),
+      (uint16_t) (uw * f), (uint16_t) (uh * f));
+}
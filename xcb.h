@@ -3,10 +3,7 @@
 
 #include "main.h"
 
-int setup_xcb(struct app_state* state);
-void cleanup_xcb(struct app_state* state);
-
-void move_resize(struct app_state* state);
-void blit(struct app_state* state);
+/* shows the overlay in an override-redirect ARGB window. */
+extern const struct output_backend xcb_output;
 
 #endif